@@ -38,6 +38,22 @@
 #define xf86ScrnToScreen(s) screenInfo.screens[(s)->scrnIndex]
 #endif
 
+/* Since 1.19 the server polls fds with a callback each, before that
+ * wakeup handlers looked for general sockets in the select mask */
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 23
+#define HAVE_NOTIFY_FD 1
+#endif
+
+/* Handlers registered with RegisterBlockAndWakeupHandlers(), which lost
+ * the select mask along with select() */
+#ifdef HAVE_NOTIFY_FD
+#define BLOCK_HANDLER_ARGS_DECL void *data, void *pTimeout
+#define WAKEUP_HANDLER_ARGS_DECL void *data, int result
+#else
+#define BLOCK_HANDLER_ARGS_DECL pointer data, OSTimePtr pTimeout, pointer pReadmask
+#define WAKEUP_HANDLER_ARGS_DECL pointer data, int result, pointer pReadmask
+#endif
+
 #ifndef XF86_SCRN_INTERFACE
 
 #define SCRN_ARG_TYPE int
@@ -76,8 +92,13 @@
 
 #define SCREEN_INIT_ARGS_DECL ScreenPtr pScreen, int argc, char **argv
 
+#ifdef HAVE_NOTIFY_FD
+#define BLOCKHANDLER_ARGS_DECL ScreenPtr arg, void *pTimeout
+#define BLOCKHANDLER_ARGS arg, pTimeout
+#else
 #define BLOCKHANDLER_ARGS_DECL ScreenPtr arg, pointer pTimeout, pointer pReadmask
 #define BLOCKHANDLER_ARGS arg, pTimeout, pReadmask
+#endif
 
 #define CLOSE_SCREEN_ARGS_DECL ScreenPtr pScreen
 #define CLOSE_SCREEN_ARGS pScreen
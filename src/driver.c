@@ -41,6 +41,7 @@
 #include <fb.h>
 #include <micmap.h>
 #include <mipointer.h>
+#include <dixstruct.h>
 #include <shadow.h>
 #include <xf86.h>
 #include <xf86Module.h>
@@ -87,8 +88,8 @@ static Bool EPHYRCreateScreenResources(ScreenPtr pScreen);
 static void EPHYRShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf);
 static Bool EPHYRCloseScreen(CLOSE_SCREEN_ARGS_DECL);
 
-static void EPHYRBlockHandler(pointer data, OSTimePtr wt, pointer LastSelectMask);
-static void EPHYRWakeupHandler(pointer data, int i, pointer LastSelectMask);
+static void EPHYRBlockHandler(BLOCK_HANDLER_ARGS_DECL);
+static void EPHYRWakeupHandler(WAKEUP_HANDLER_ARGS_DECL);
 
 int EPHYRValidateModes(ScrnInfoPtr pScrn);
 Bool EPHYRAddMode(ScrnInfoPtr pScrn, int width, int height);
@@ -97,7 +98,22 @@ void EPHYRPrintMode(ScrnInfoPtr p, DisplayModePtr m);
 
 typedef enum {
     OPTION_DISPLAY,
-    OPTION_XAUTHORITY
+    OPTION_XAUTHORITY,
+    OPTION_ASYNC_PRESENT,
+    OPTION_MAX_FRAMES_IN_FLIGHT,
+    OPTION_SHM_BUFFERS,
+    OPTION_HUGE_PAGES,
+    OPTION_PRESENT,
+    OPTION_PRESENT_THREADS,
+    OPTION_SCROLL_DETECTION,
+    OPTION_HOST_TRANSFORM,
+    OPTION_HOST_SCALE,
+    OPTION_BACKING_PIXMAP,
+    OPTION_MAX_FPS,
+    OPTION_PRESENTER_THREAD,
+    OPTION_TILE_HASH,
+    OPTION_MOTION_HISTORY,
+    OPTION_XINPUT2
 } EphyrOpts;
 
 typedef enum {
@@ -115,6 +131,21 @@ static SymTabRec EPHYRChipsets[] = {
 static OptionInfoRec EPHYROptions[] = {
     { OPTION_DISPLAY,    "Display",    OPTV_STRING, {0}, FALSE },
     { OPTION_XAUTHORITY, "Xauthority", OPTV_STRING, {0}, FALSE },
+    { OPTION_ASYNC_PRESENT, "AsyncPresent", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_MAX_FRAMES_IN_FLIGHT, "MaxFramesInFlight", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_SHM_BUFFERS, "ShmBuffers", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_HUGE_PAGES, "HugePages", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_PRESENT, "Present", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_PRESENT_THREADS, "PresentThreads", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_SCROLL_DETECTION, "ScrollDetection", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_HOST_TRANSFORM, "HostTransform", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_HOST_SCALE, "HostScale", OPTV_REAL, {0}, FALSE },
+    { OPTION_BACKING_PIXMAP, "BackingPixmap", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_MAX_FPS, "MaxFPS", OPTV_INTEGER, {0}, FALSE },
+    { OPTION_PRESENTER_THREAD, "PresenterThread", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_TILE_HASH, "TileHash", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_MOTION_HISTORY, "MotionHistory", OPTV_BOOLEAN, {0}, FALSE },
+    { OPTION_XINPUT2, "XInput2", OPTV_BOOLEAN, {0}, FALSE },
     { -1,                NULL,         OPTV_NONE,   {0}, FALSE }
 };
 
@@ -353,6 +384,106 @@ EPHYRPreInit(ScrnInfoPtr pScrn, int flags) {
                                    OPTION_XAUTHORITY), 1);
     }
 
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_ASYNC_PRESENT, FALSE)) {
+        int maxFrames = 2;
+
+        xf86GetOptValInteger(EPHYROptions, OPTION_MAX_FRAMES_IN_FLIGHT,
+                             &maxFrames);
+        hostx_use_async_present(maxFrames);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Using asynchronous presentation, up to %d frames in flight\n",
+                   maxFrames);
+    }
+
+    if (xf86IsOptionSet(EPHYROptions, OPTION_SHM_BUFFERS)) {
+        int shmBuffers = 1;
+
+        xf86GetOptValInteger(EPHYROptions, OPTION_SHM_BUFFERS, &shmBuffers);
+        hostx_use_shm_buffers(shmBuffers);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Using up to %d SHM buffers\n", shmBuffers);
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_HUGE_PAGES, FALSE)) {
+        hostx_use_huge_pages();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Backing SHM buffers with huge pages when possible\n");
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_PRESENT, FALSE)) {
+        hostx_use_present();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Presenting frames with the host Present extension\n");
+    }
+
+    if (xf86IsOptionSet(EPHYROptions, OPTION_PRESENT_THREADS)) {
+        int presentThreads = 0;
+
+        xf86GetOptValInteger(EPHYROptions, OPTION_PRESENT_THREADS,
+                             &presentThreads);
+        hostx_use_present_threads(presentThreads);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Converting damage with %d worker threads\n",
+                   presentThreads);
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_SCROLL_DETECTION, FALSE)) {
+        hostx_use_scroll_detection();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Copying scrolled areas within the host window\n");
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_HOST_TRANSFORM, FALSE)) {
+        double hostScale = 1.0;
+
+        xf86GetOptValReal(EPHYROptions, OPTION_HOST_SCALE, &hostScale);
+        hostx_use_host_transform(hostScale);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Rotating and scaling (by %.2f) on the host with RENDER\n",
+                   hostScale);
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_BACKING_PIXMAP, FALSE)) {
+        hostx_use_backing_pixmap();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Keeping a copy of the framebuffer in a host pixmap\n");
+    }
+
+    if (xf86IsOptionSet(EPHYROptions, OPTION_MAX_FPS)) {
+        int maxFPS = 0;
+
+        xf86GetOptValInteger(EPHYROptions, OPTION_MAX_FPS, &maxFPS);
+        hostx_use_max_fps(maxFPS);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Presenting at most %d frames per second\n", maxFPS);
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_PRESENTER_THREAD, FALSE)) {
+        hostx_use_presenter_thread();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Putting frames on the host from a separate thread\n");
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_TILE_HASH, FALSE)) {
+        hostx_use_tile_hash();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Skipping damaged tiles whose content did not change\n");
+    }
+
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_MOTION_HISTORY, FALSE)) {
+        EphyrWantMotionHistory = TRUE;
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Passing on every host motion event\n");
+    }
+
+    /* XI2 events are posted to our input device */
+    if (xf86ReturnOptValBool(EPHYROptions, OPTION_XINPUT2, FALSE) &&
+        enable_ephyr_input) {
+        hostx_use_xinput2();
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Using XInput 2 pointer events from the host\n");
+    }
+
     xf86ShowUnusedOptions(pScrn->scrnIndex, pScrn->options);
 
     if (hostx_get_xcbconn() != NULL) {
@@ -535,12 +666,120 @@ EPHYRMouseTimer(OsTimerPtr timer, CARD32 time, pointer arg) {
 }
 
 static void
-EPHYRBlockHandler(pointer data, OSTimePtr wt, pointer LastSelectMask) {
+EPHYRBlockHandler(BLOCK_HANDLER_ARGS_DECL) {
+    EphyrScrPrivPtr scrpriv = data;
+
+    /* Exposures a damage frame did not take care of */
+    hostx_paint_exposures(scrpriv->screen);
+}
+
+/**
+ * Runs after the shadow layer painted the screen.  The replies painting
+ * waited for may have brought host events in, and those do not make the
+ * connection readable again: process them now, and have the server look
+ * at the input they queued before going to sleep.
+ */
+static void
+EPHYRScreenBlockHandler(BLOCKHANDLER_ARGS_DECL) {
+    SCREEN_PTR(arg);
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    EphyrScrPrivPtr scrpriv = pScrn->driverPrivate;
+
+    pScreen->BlockHandler = scrpriv->BlockHandler;
+    (*pScreen->BlockHandler)(BLOCKHANDLER_ARGS);
+    pScreen->BlockHandler = EPHYRScreenBlockHandler;
+
+    if (ephyrPollQueued()) {
+        AdjustWaitForDelay(pTimeout, 0);
+    }
+}
+
+#ifdef HAVE_NOTIFY_FD
+static void
+EPHYRNotifyFd(int fd, int ready, void *data) {
     ephyrPoll();
 }
 
 static void
-EPHYRWakeupHandler(pointer data, int i, pointer LastSelectMask) {
+EPHYRPresenterNotifyFd(int fd, int ready, void *data) {
+    hostx_presenter_done(data);
+}
+#endif
+
+static void
+EPHYRWakeupHandler(WAKEUP_HANDLER_ARGS_DECL) {
+#ifndef HAVE_NOTIFY_FD
+    EphyrScrPrivPtr scrpriv = data;
+    int fd = xcb_get_file_descriptor(hostx_get_xcbconn());
+    int presenter_fd = hostx_get_presenter_fd(scrpriv->screen);
+
+    if (result > 0 && FD_ISSET(fd, (fd_set *) pReadmask)) {
+        ephyrPoll();
+    }
+
+    if (result > 0 && presenter_fd >= 0 &&
+        FD_ISSET(presenter_fd, (fd_set *) pReadmask)) {
+        hostx_presenter_done(scrpriv->screen);
+    }
+#endif
+}
+
+/**
+ * Has the server wake us up as soon as the host sends something, instead
+ * of waiting for other activity to process host events.  Screens share
+ * the host connection; the first one watches it for all of them.  Each
+ * screen watches its own presenter thread, which says when it has room
+ * for a frame again.
+ */
+static void
+EPHYRWatchHost(ScreenPtr pScreen) {
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    int fd = xcb_get_file_descriptor(hostx_get_xcbconn());
+    int presenter_fd = hostx_get_presenter_fd(pScrn);
+
+    if (presenter_fd >= 0) {
+#ifdef HAVE_NOTIFY_FD
+        SetNotifyFd(presenter_fd, EPHYRPresenterNotifyFd, X_NOTIFY_READ,
+                    pScrn);
+#else
+        AddGeneralSocket(presenter_fd);
+#endif
+    }
+
+    if (pScreen->myNum != 0) {
+        return;
+    }
+
+#ifdef HAVE_NOTIFY_FD
+    SetNotifyFd(fd, EPHYRNotifyFd, X_NOTIFY_READ, NULL);
+#else
+    AddGeneralSocket(fd);
+#endif
+}
+
+static void
+EPHYRUnwatchHost(ScreenPtr pScreen) {
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    int fd = xcb_get_file_descriptor(hostx_get_xcbconn());
+    int presenter_fd = hostx_get_presenter_fd(pScrn);
+
+    if (presenter_fd >= 0) {
+#ifdef HAVE_NOTIFY_FD
+        RemoveNotifyFd(presenter_fd);
+#else
+        RemoveGeneralSocket(presenter_fd);
+#endif
+    }
+
+    if (pScreen->myNum != 0) {
+        return;
+    }
+
+#ifdef HAVE_NOTIFY_FD
+    RemoveNotifyFd(fd);
+#else
+    RemoveGeneralSocket(fd);
+#endif
 }
 
 /* Called at each server generation */
@@ -626,7 +865,10 @@ static Bool EPHYRScreenInit(SCREEN_INIT_ARGS_DECL) {
     pScreen->CreateScreenResources = EPHYRCreateScreenResources;
     scrpriv->CloseScreen = pScreen->CloseScreen;
     pScreen->CloseScreen = EPHYRCloseScreen;
+    scrpriv->BlockHandler = pScreen->BlockHandler;
+    pScreen->BlockHandler = EPHYRScreenBlockHandler;
     RegisterBlockAndWakeupHandlers(EPHYRBlockHandler, EPHYRWakeupHandler, scrpriv);
+    EPHYRWatchHost(pScreen);
     return TRUE;
 }
 
@@ -664,7 +906,20 @@ EPHYRCloseScreen(CLOSE_SCREEN_ARGS_DECL) {
     xf86DrvMsg(pScrn->scrnIndex, X_INFO, "EPHYRCloseScreen\n");
     shadowRemove(pScreen, pScreen->GetScreenPixmap(pScreen));
     RemoveBlockAndWakeupHandlers(EPHYRBlockHandler, EPHYRWakeupHandler, scrpriv);
+    EPHYRUnwatchHost(pScreen);
     hostx_close_screen(pScrn);
+
+    /* Threads are kept across resets, but not when the server quits.
+     * Screen 0 is the last one closed. */
+    if (dispatchException & DE_TERMINATE) {
+        hostx_free_screen(pScrn);
+
+        if (pScreen->myNum == 0) {
+            hostx_fini();
+        }
+    }
+
+    pScreen->BlockHandler = scrpriv->BlockHandler;
     pScreen->CloseScreen = scrpriv->CloseScreen;
     return (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
 }
@@ -699,6 +954,10 @@ static void EPHYRLeaveVT(VT_FUNC_ARGS_DECL) {
 static void EPHYRFreeScreen(FREE_SCREEN_ARGS_DECL) {
     SCRN_INFO_PTR(arg);
     xf86DrvMsg(pScrn->scrnIndex, X_INFO, "EPHYRFreeScreen\n");
+
+    if (pScrn->driverPrivate) {
+        hostx_free_screen(pScrn);
+    }
 }
 
 static ModeStatus EPHYRValidMode(SCRN_ARG_TYPE arg, DisplayModePtr mode,
@@ -27,14 +27,14 @@
 #include <kdrive-config.h>
 #endif
 
-#include <xcb/xcb_keysyms.h>
-#include <X11/keysym.h>
-
 #include "ephyr.h"
 
 #include "inputstr.h"
 #include "scrnintstr.h"
 #include "ephyrlog.h"
+#include "ephyrrotate.h"
+#include "ephyrwindows.h"
+#include "ephyr_input.h"
 
 #ifdef XF86DRI
 #include <xcb/xf86dri.h>
@@ -68,6 +68,7 @@ typedef struct _EphyrInputPrivate {
 Bool EphyrWantGrayScale = 0;
 Bool EphyrWantResize = 0;
 Bool EphyrWantNoHostGrab = 0;
+Bool EphyrWantMotionHistory = 0;
 
 Bool
 ephyrInitialize(KdCardInfo * card, EphyrPriv * priv)
@@ -248,6 +249,14 @@ ephyrMapFramebuffer(ScrnInfoPtr screen) {
         screen->fb.pixelStride = screen->width;
         screen->fb.frameBuffer = (CARD8 *) (priv->base);
     }
+    else if (hostx_want_host_transform(screen)) {
+        /* The host rotates the fb, which keeps the screen orientation */
+        scrpriv->shadow = FALSE;
+
+        screen->fb.byteStride = priv->bytes_per_line;
+        screen->fb.pixelStride = scrpriv->fb_width;
+        screen->fb.frameBuffer = (CARD8 *) (priv->base);
+    }
     else {
         /* Rotated/Reflected so we need to use shadow fb */
         scrpriv->shadow = TRUE;
@@ -298,16 +307,67 @@ ephyrUnmapFramebuffer(KdScreenInfo * screen)
 void
 ephyrShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf)
 {
+    KdScreenPriv(pScreen);
+    EphyrPriv *priv = pScreenPriv->card->driver;
     ScrnInfoPtr screen = xf86ScreenToScrn(pScreen);
+    PixmapPtr pShadow = pBuf->pPixmap;
+    RegionPtr damage = DamageRegion(pBuf->pDamage);
+    int width = pShadow->drawable.width;
+    int height = pShadow->drawable.height;
+    int nbox = RegionNumRects(damage);
+    BoxPtr pbox = RegionRects(damage);
+    int x_dir, y_dir, i;
+    xRectangle *rects;
+    RegionPtr host;
 
     EPHYR_LOG("slow paint");
 
-    /* FIXME: Slow Rotated/Reflected updates could be much
-     * much faster efficiently updating via tranforming
-     * pBuf->pDamage  regions
+    if (!nbox)
+        return;
+
+    /* Only repaint the host fb boxes showing damaged shadow boxes */
+    ephyr_rotation_dirs(pBuf->randr, &x_dir, &y_dir);
+
+    rects = xallocarray(nbox, sizeof(xRectangle));
+    if (!rects) {
+        shadowUpdateRotatePacked(pScreen, pBuf);
+        hostx_paint_rect(screen, 0, 0, 0, 0, screen->width, screen->height);
+        return;
+    }
+
+    for (i = 0; i < nbox; i++, pbox++) {
+        BoxRec box;
+
+        ephyr_rotate_box(x_dir, y_dir, width, height, pbox, &box);
+        rects[i].x = box.x1;
+        rects[i].y = box.y1;
+        rects[i].width = box.x2 - box.x1;
+        rects[i].height = box.y2 - box.y1;
+    }
+
+    /*
+     * Our tiled kernels rotate straight into the fb, which is the XImage
+     * itself when it can be; other depths use the generic shadow code.
      */
-    shadowUpdateRotatePacked(pScreen, pBuf);
-    hostx_paint_rect(screen, 0, 0, 0, 0, screen->width, screen->height);
+    if (pShadow->drawable.bitsPerPixel == screen->bitsPerPixel &&
+        (screen->bitsPerPixel == 16 || screen->bitsPerPixel == 32)) {
+        for (i = 0; i < nbox; i++) {
+            ephyr_rotate_rect(priv->base, priv->bytes_per_line,
+                              pShadow->devPrivate.ptr, pShadow->devKind,
+                              pShadow->drawable.bitsPerPixel,
+                              x_dir, y_dir, width, height,
+                              rects[i].x, rects[i].y,
+                              rects[i].width, rects[i].height);
+        }
+    } else {
+        shadowUpdateRotatePacked(pScreen, pBuf);
+    }
+
+    host = RegionFromRects(nbox, rects, CT_NONE);
+    free(rects);
+
+    hostx_paint_region(screen, host);
+    RegionDestroy(host);
 }
 
 static void
@@ -324,25 +384,15 @@ ephyrInternalDamageRedisplay(ScreenPtr pScreen)
     pRegion = DamageRegion(scrpriv->pDamage);
 
     if (RegionNotEmpty(pRegion)) {
-        int nbox;
-        BoxPtr pbox;
-
         if (ephyr_glamor) {
             ephyr_glamor_damage_redisplay(scrpriv->glamor, pRegion);
         } else {
-            nbox = RegionNumRects(pRegion);
-            pbox = RegionRects(pRegion);
-
-            while (nbox--) {
-                hostx_paint_rect(screen,
-                                 pbox->x1, pbox->y1,
-                                 pbox->x1, pbox->y1,
-                                 pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
-                pbox++;
-            }
+            hostx_paint_region(screen, pRegion);
         }
         DamageEmpty(scrpriv->pDamage);
     }
+
+    hostx_paint_exposures(screen);
 }
 
 static void
@@ -852,10 +902,8 @@ miPointerScreenFuncRec ephyrPointerScreenFuncs = {
 
 #ifdef XF86DRI
 /**
- * find if the remote window denoted by a_remote
- * is paired with an internal Window within the Xephyr server.
- * If the remove window is paired with an internal window, send an
- * expose event to the client insterested in the internal window expose event.
+ * Sends an expose event to the clients interested in the internal
+ * window of a_pair, whose remote window was exposed on the host.
  *
  * Pairing happens when a drawable inside Xephyr is associated with
  * a GL surface in a DRI environment.
@@ -866,16 +914,11 @@ miPointerScreenFuncRec ephyrPointerScreenFuncs = {
  * expose events and send those events to clients.
  */
 static void
-ephyrExposePairedWindow(int a_remote)
+ephyrExposePairedWindow(EphyrWindowPair *pair)
 {
-    EphyrWindowPair *pair = NULL;
     RegionRec reg;
     ScreenPtr screen;
 
-    if (!findWindowPairFromRemote(a_remote, &pair)) {
-        EPHYR_LOG("did not find a pair for this window\n");
-        return;
-    }
     screen = pair->local->drawable.pScreen;
     RegionNull(&reg);
     RegionCopy(&reg, &pair->local->clipList);
@@ -885,24 +928,21 @@ ephyrExposePairedWindow(int a_remote)
 #endif                          /* XF86DRI */
 
 static KdScreenInfo *
-screen_from_window(Window w)
+screen_from_host_window(const EphyrHostWindow *window)
 {
-    int i = 0;
+    KdPrivScreenPtr kdscrpriv;
 
-    for (i = 0; i < screenInfo.numScreens; i++) {
-        ScreenPtr pScreen = screenInfo.screens[i];
-        KdPrivScreenPtr kdscrpriv = KdGetScreenPriv(pScreen);
-        KdScreenInfo *screen = kdscrpriv->screen;
-        EphyrScrPriv *scrpriv = screen->driver;
+    if (!window)
+        return NULL;
 
-        if (scrpriv->win == w
-            || scrpriv->peer_win == w
-            || scrpriv->win_pre_existing == w) {
-            return screen;
-        }
-    }
+    kdscrpriv = KdGetScreenPriv(window->scrpriv->screen->pScreen);
+    return kdscrpriv->screen;
+}
 
-    return NULL;
+static KdScreenInfo *
+screen_from_window(Window w)
+{
+    return screen_from_host_window(ephyr_window_lookup(w));
 }
 
 static void
@@ -925,21 +965,31 @@ static void
 ephyrProcessExpose(xcb_generic_event_t *xev)
 {
     xcb_expose_event_t *expose = (xcb_expose_event_t *)xev;
-    KdScreenInfo *screen = screen_from_window(expose->window);
-    EphyrScrPriv *scrpriv = screen->driver;
+    const EphyrHostWindow *window = ephyr_window_lookup(expose->window);
+    EphyrScrPriv *scrpriv = NULL;
 
-    /* Wait for the last expose event in a series of cliprects
-     * to actually paint our screen.
+    /* DRI peer windows show GL drawables, not the screen */
+    if (window && !window->pair)
+        scrpriv = window->scrpriv;
+
+    /* With a backing pixmap on the host, every cliprect is copied from
+     * it and nothing is uploaded again.
      */
-    if (expose->count != 0)
+    if (scrpriv &&
+        hostx_expose_rect(scrpriv->screen, expose->x, expose->y,
+                          expose->width, expose->height)) {
+        if (expose->count == 0)
+            xcb_flush(hostx_get_xcbconn());
         return;
+    }
 
+    /* Otherwise the cliprects of the series are painted together,
+     * with the damage of the next block handler.
+     */
     if (scrpriv) {
-        hostx_paint_rect(scrpriv->screen, 0, 0, 0, 0,
-                         scrpriv->win_width,
-                         scrpriv->win_height);
-    } else {
-        EPHYR_LOG_ERROR("failed to get host screen\n");
+        hostx_add_exposure(scrpriv->screen, expose->x, expose->y,
+                           expose->width, expose->height);
+    } else if (expose->count == 0) {
 #ifdef XF86DRI
         /*
          * We only receive expose events when the expose event
@@ -948,8 +998,12 @@ ephyrProcessExpose(xcb_generic_event_t *xev)
          * Xephyr exists for instance when Xephyr is asked to
          * create a GL drawable in a DRI environment.
          */
-        ephyrExposePairedWindow(expose->window);
+        if (window && window->pair) {
+            ephyrExposePairedWindow(window->pair);
+            return;
+        }
 #endif                          /* XF86DRI */
+        EPHYR_LOG_ERROR("failed to get host screen\n");
     }
 }
 
@@ -957,7 +1011,14 @@ static void
 ephyrProcessMouseMotion(xcb_generic_event_t *xev)
 {
     xcb_motion_notify_event_t *motion = (xcb_motion_notify_event_t *)xev;
-    KdScreenInfo *screen = screen_from_window(motion->event);
+    const EphyrHostWindow *window = ephyr_window_lookup(motion->event);
+    KdScreenInfo *screen = screen_from_host_window(window);
+    EphyrScrPriv *scrpriv;
+
+    if (!screen)
+        return;
+
+    scrpriv = screen->driver;
 
     if (!ephyrMouse ||
         !((EphyrPointerPrivate *) ephyrMouse->driverPrivate)->enabled) {
@@ -966,25 +1027,29 @@ ephyrProcessMouseMotion(xcb_generic_event_t *xev)
     }
 
     if (ephyrCursorScreen != screen->pScreen) {
+        int x = motion->event_x, y = motion->event_y;
+
         EPHYR_LOG("warping mouse cursor. "
                   "cur_screen:%d, motion_screen:%d\n",
                   ephyrCursorScreen->myNum, screen->pScreen->myNum);
-        ephyrWarpCursor(inputInfo.pointer, screen->pScreen,
-                        motion->event_x, motion->event_y);
+        hostx_unscale_pointer(scrpriv->screen, &x, &y);
+        ephyrWarpCursor(inputInfo.pointer, screen->pScreen, x, y);
     }
     else {
         int x = 0, y = 0;
 
 #ifdef XF86DRI
-        EphyrWindowPair *pair = NULL;
+        EphyrWindowPair *pair = window->pair;
 #endif
         EPHYR_LOG("enqueuing mouse motion:%d\n", screen->pScreen->myNum);
         x = motion->event_x;
         y = motion->event_y;
+        if (motion->event == scrpriv->win)
+            hostx_unscale_pointer(scrpriv->screen, &x, &y);
         EPHYR_LOG("initial (x,y):(%d,%d)\n", x, y);
 #ifdef XF86DRI
         EPHYR_LOG("is this window peered by a gl drawable ?\n");
-        if (findWindowPairFromRemote(motion->event, &pair)) {
+        if (pair) {
             EPHYR_LOG("yes, it is peered\n");
             x += pair->local->drawable.x;
             y += pair->local->drawable.y;
@@ -1009,10 +1074,14 @@ static void
 ephyrProcessButtonPress(xcb_generic_event_t *xev)
 {
     xcb_button_press_event_t *button = (xcb_button_press_event_t *)xev;
+    KdScreenInfo *screen = screen_from_window(button->event);
+
+    if (!screen)
+        return;
 
     if (!ephyrMouse ||
         !((EphyrPointerPrivate *) ephyrMouse->driverPrivate)->enabled) {
-        EPHYR_LOG("skipping mouse press:%d\n", screen_from_window(button->event)->pScreen->myNum);
+        EPHYR_LOG("skipping mouse press:%d\n", screen->pScreen->myNum);
         return;
     }
 
@@ -1022,7 +1091,7 @@ ephyrProcessButtonPress(xcb_generic_event_t *xev)
      */
     mouseState |= 1 << (button->detail - 1);
 
-    EPHYR_LOG("enqueuing mouse press:%d\n", screen_from_window(button->event)->pScreen->myNum);
+    EPHYR_LOG("enqueuing mouse press:%d\n", screen->pScreen->myNum);
     KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_MOUSE_DELTA, 0, 0, 0);
 }
 
@@ -1030,6 +1099,10 @@ static void
 ephyrProcessButtonRelease(xcb_generic_event_t *xev)
 {
     xcb_button_press_event_t *button = (xcb_button_press_event_t *)xev;
+    KdScreenInfo *screen = screen_from_window(button->event);
+
+    if (!screen)
+        return;
 
     if (!ephyrMouse ||
         !((EphyrPointerPrivate *) ephyrMouse->driverPrivate)->enabled) {
@@ -1039,10 +1112,123 @@ ephyrProcessButtonRelease(xcb_generic_event_t *xev)
     ephyrUpdateModifierState(button->state);
     mouseState &= ~(1 << (button->detail - 1));
 
-    EPHYR_LOG("enqueuing mouse release:%d\n", screen_from_window(button->event)->pScreen->myNum);
+    EPHYR_LOG("enqueuing mouse release:%d\n", screen->pScreen->myNum);
     KdEnqueuePointerEvent(ephyrMouse, mouseState | KD_MOUSE_DELTA, 0, 0, 0);
 }
 
+/**
+ * XI2 motion keeps the fraction of a pixel of the host position, and
+ * carries the scroll valuators that make for smooth scrolling.
+ */
+static void
+ephyrProcessXI2Motion(xcb_generic_event_t *xev)
+{
+    xcb_input_motion_event_t *motion = (xcb_input_motion_event_t *)xev;
+    const EphyrHostWindow *window = ephyr_window_lookup(motion->event);
+    KdScreenInfo *screen = screen_from_host_window(window);
+    DeviceIntPtr dev = EPHYRInputGetDevice();
+    EphyrScrPriv *scrpriv;
+    double x, y, dx, dy;
+
+    if (!screen || !dev)
+        return;
+
+    scrpriv = screen->driver;
+
+    if (hostx_xi2_scroll(motion, &dx, &dy)) {
+        EPHYR_LOG("posting scroll:%f,%f\n", dx, dy);
+        EPHYRInputPostScrollEvent(dev, dx, dy);
+
+        /* Valuators 0 and 1 are the position */
+        if (!(xcb_input_button_press_valuator_mask(motion)[0] & 0x3))
+            return;
+    }
+
+    x = motion->event_x / 65536.0;
+    y = motion->event_y / 65536.0;
+    if (motion->event == scrpriv->win)
+        hostx_unscale_pointer_fp(scrpriv->screen, &x, &y);
+
+    if (ephyrCursorScreen != screen->pScreen) {
+        EPHYR_LOG("warping mouse cursor. "
+                  "cur_screen:%d, motion_screen:%d\n",
+                  ephyrCursorScreen->myNum, screen->pScreen->myNum);
+        ephyrWarpCursor(inputInfo.pointer, screen->pScreen, x, y);
+        return;
+    }
+
+#ifdef XF86DRI
+    if (window->pair) {
+        EphyrWindowPair *pair = window->pair;
+
+        x += pair->local->drawable.x;
+        y += pair->local->drawable.y;
+    }
+#endif
+
+    /* Desktop-wide coordinates, as for core motion */
+    x += screen->pScreen->x;
+    y += screen->pScreen->y;
+
+    EPHYRInputPostSubpixelMotionEvent(dev, x, y);
+}
+
+/**
+ * XI2 buttons are posted by number, whatever their number is.
+ */
+static void
+ephyrProcessXI2Button(xcb_generic_event_t *xev, Bool isDown)
+{
+    xcb_input_button_press_event_t *button =
+        (xcb_input_button_press_event_t *)xev;
+    DeviceIntPtr dev = EPHYRInputGetDevice();
+
+    if (!dev || !screen_from_window(button->event))
+        return;
+
+    /* The host emulates wheel clicks from the scroll valuators, which
+     * we already posted as such */
+    if (button->flags & XCB_INPUT_POINTER_EVENT_FLAGS_POINTER_EMULATED)
+        return;
+
+    ephyrUpdateModifierState(button->mods.effective);
+
+    EPHYR_LOG("posting button %d %s\n", button->detail,
+              isDown ? "press" : "release");
+    EPHYRInputPostButtonEvent(dev, button->detail, isDown);
+}
+
+static void
+ephyrProcessGenericEvent(xcb_generic_event_t *xev)
+{
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)xev;
+
+    if (ge->extension != hostx_get_xi2_opcode())
+        return;
+
+    switch (ge->event_type) {
+    case XCB_INPUT_MOTION:
+        ephyrProcessXI2Motion(xev);
+        break;
+
+    case XCB_INPUT_BUTTON_PRESS:
+        ephyrProcessXI2Button(xev, TRUE);
+        break;
+
+    case XCB_INPUT_BUTTON_RELEASE:
+        ephyrProcessXI2Button(xev, FALSE);
+        break;
+
+    case XCB_INPUT_DEVICE_CHANGED:
+        hostx_xi2_device_changed();
+        break;
+
+    case XCB_INPUT_ENTER:
+        hostx_xi2_enter();
+        break;
+    }
+}
+
 /* Xephyr wants ctrl+shift to grab the window, but that conflicts with
    ctrl+alt+shift key combos. Remember the modifier state on key presses and
    releases, if mod1 is pressed, we need ctrl, shift and mod1 released
@@ -1086,20 +1272,15 @@ ephyrProcessKeyRelease(xcb_generic_event_t *xev)
 {
     xcb_connection_t *conn = hostx_get_xcbconn();
     xcb_key_release_event_t *key = (xcb_key_release_event_t *)xev;
-    static xcb_key_symbols_t *keysyms;
+    uint8_t key_class = hostx_get_key_class(key->detail);
     static int grabbed_screen = -1;
     int mod1_down = ephyrUpdateGrabModifierState(key->state);
 
-    if (!keysyms)
-        keysyms = xcb_key_symbols_alloc(conn);
-
     if (!EphyrWantNoHostGrab &&
-        (((xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Shift_L
-          || xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Shift_R)
-         && (key->state & XCB_MOD_MASK_CONTROL)) ||
-        ((xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Control_L
-          || xcb_key_symbols_get_keysym(keysyms, key->detail, 0) == XK_Control_R)
-         && (key->state & XCB_MOD_MASK_SHIFT)))) {
+        (((key_class & EPHYR_KEY_CLASS_SHIFT)
+          && (key->state & XCB_MOD_MASK_CONTROL)) ||
+         ((key_class & EPHYR_KEY_CLASS_CONTROL)
+          && (key->state & XCB_MOD_MASK_SHIFT)))) {
         KdScreenInfo *screen = screen_from_window(key->event);
         EphyrScrPriv *scrpriv = screen->driver;
 
@@ -1183,13 +1364,97 @@ ephyrProcessConfigureNotify(xcb_generic_event_t *xev)
 #endif /* RANDR */
 }
 
-void
-ephyrPoll(void)
+static Bool
+ephyrIsXI2Motion(xcb_generic_event_t *xev)
+{
+    xcb_ge_generic_event_t *ge = (xcb_ge_generic_event_t *)xev;
+
+    return (xev->response_type & 0x7f) == XCB_GE_GENERIC &&
+        ge->extension == hostx_get_xi2_opcode() &&
+        ge->event_type == XCB_INPUT_MOTION;
+}
+
+static Bool
+ephyrIsMotion(xcb_generic_event_t *xev)
+{
+    return (xev->response_type & 0x7f) == XCB_MOTION_NOTIFY ||
+        ephyrIsXI2Motion(xev);
+}
+
+/**
+ * Returns TRUE if the motion event next makes the motion event xev
+ * pointless: the pointer only moved on within the same window.  XI2
+ * scroll valuators are absolute, so the later event covers the scrolling
+ * of the earlier one as long as it carries all of its valuators.
+ */
+static Bool
+ephyrMotionSupersedes(xcb_generic_event_t *xev, xcb_generic_event_t *next)
+{
+    if (ephyrIsXI2Motion(xev)) {
+        xcb_input_motion_event_t *motion = (xcb_input_motion_event_t *)xev;
+        xcb_input_motion_event_t *later = (xcb_input_motion_event_t *)next;
+        uint32_t *mask, *later_mask;
+        int i;
+
+        if (!ephyrIsXI2Motion(next) ||
+            later->event != motion->event ||
+            later->deviceid != motion->deviceid ||
+            later->valuators_len < motion->valuators_len)
+            return FALSE;
+
+        mask = xcb_input_button_press_valuator_mask(motion);
+        later_mask = xcb_input_button_press_valuator_mask(later);
+        for (i = 0; i < motion->valuators_len; i++) {
+            if (mask[i] & ~later_mask[i])
+                return FALSE;
+        }
+
+        return TRUE;
+    }
+    else {
+        xcb_motion_notify_event_t *motion = (xcb_motion_notify_event_t *)xev;
+        xcb_motion_notify_event_t *later = (xcb_motion_notify_event_t *)next;
+
+        return (next->response_type & 0x7f) == XCB_MOTION_NOTIFY &&
+            later->event == motion->event &&
+            later->state == motion->state &&
+            later->same_screen == motion->same_screen;
+    }
+}
+
+/**
+ * Processes the host events poll_for_event returns until there are none
+ * left.
+ *
+ * Unless every motion event is wanted, a motion event followed in the
+ * queue by another one for the same window is dropped, so that bursts
+ * from high rate mice only move the pointer once.  The event that ends a
+ * burst is kept for the next iteration.
+ *
+ * Returns whether any event was processed.
+ */
+static Bool
+ephyrProcessEvents(xcb_generic_event_t *(*poll_for_event)(xcb_connection_t *))
 {
     xcb_connection_t *conn = hostx_get_xcbconn();
+    xcb_generic_event_t *next = NULL;
+    Bool processed = FALSE;
 
     while (TRUE) {
-        xcb_generic_event_t *xev = xcb_poll_for_event(conn);
+        xcb_generic_event_t *xev = next ? next : poll_for_event(conn);
+
+        next = NULL;
+
+        while (xev && !EphyrWantMotionHistory && ephyrIsMotion(xev)) {
+            next = xcb_poll_for_queued_event(conn);
+            if (!next || !ephyrMotionSupersedes(xev, next))
+                break;
+
+            free(xev);
+            xev = next;
+            next = NULL;
+        }
+
         if (!xev) {
             /* If our XCB connection has died (for example, our window was
              * closed), exit now.
@@ -1203,6 +1468,13 @@ ephyrPoll(void)
             break;
         }
 
+        processed = TRUE;
+
+        if (hostx_process_event(xev)) {
+            free(xev);
+            continue;
+        }
+
         switch (xev->response_type & 0x7f) {
         case 0:
             ephyrProcessErrorEvent(xev);
@@ -1235,6 +1507,10 @@ ephyrPoll(void)
         case XCB_CONFIGURE_NOTIFY:
             ephyrProcessConfigureNotify(xev);
             break;
+
+        case XCB_GE_GENERIC:
+            ephyrProcessGenericEvent(xev);
+            break;
         }
 
         if (ephyr_glamor)
@@ -1242,6 +1518,29 @@ ephyrPoll(void)
 
         free(xev);
     }
+
+    return processed;
+}
+
+/**
+ * Reads and processes everything the host sent.  Called when the host
+ * connection is readable.
+ */
+void
+ephyrPoll(void)
+{
+    ephyrProcessEvents(xcb_poll_for_event);
+}
+
+/**
+ * Processes the events xcb already read while waiting for replies; the
+ * connection does not become readable again for those.  Returns whether
+ * there were any.
+ */
+Bool
+ephyrPollQueued(void)
+{
+    return ephyrProcessEvents(xcb_poll_for_queued_event);
 }
 
 void
@@ -31,6 +31,7 @@
 #include <signal.h>
 #include <libgen.h>
 #include <xcb/xcb_image.h>
+#include <xcb/present.h>
 
 #include "os.h"                 /* for OsSignal() */
 #include "hostx.h"
@@ -42,11 +43,28 @@
 
 #include "damage.h"
 
+/* Upper bound for the "MaxFramesInFlight" option */
+#define EPHYR_MAX_FRAMES_IN_FLIGHT 8
+
+/* Upper bound for the "ShmBuffers" option */
+#define EPHYR_MAX_SHM_BUFFERS 3
+
 typedef struct _ephyrPriv {
     CARD8 *base;
     int bytes_per_line;
 } EphyrPriv;
 
+typedef struct _ephyrHostBuffer {
+    xcb_image_t *ximg;
+    xcb_shm_segment_info_t shminfo;
+    size_t shm_size;            /* mapping size of memfd segments, else 0 */
+    xcb_pixmap_t pixmap;        /* host SHM pixmap, with Present only */
+    Bool busy;                  /* the host may still read from it */
+    unsigned int busy_seq;      /* sequence number of the last put */
+    RegionRec stale;            /* fb areas changed since the last copy */
+    int presenting;             /* owned by the presenter thread */
+} EphyrHostBuffer;
+
 typedef struct _ephyrFakexaPriv {
     ExaDriverPtr exa;
     Bool is_synced;
@@ -72,14 +90,72 @@ typedef struct _ephyrScrPriv {
     xcb_window_t win;
     xcb_window_t win_pre_existing;    /* Set via xorg.conf option "ParentWindow" */
     xcb_window_t peer_win;            /* Used for GL; should be at most one */
-    xcb_image_t *ximg;
     Bool win_explicit_position;
     int win_x, win_y;
     int win_width, win_height;
+    int fb_width, fb_height;    /* differ from the window's when the
+                                   host transforms the fb */
+    RegionRec pending_region;   /* exposed or deferred since the last
+                                   frame */
+    OsTimerPtr frame_timer;     /* presents deferred damage */
+    Bool frame_pending;
+    CARD32 last_frame;          /* when the last frame was presented */
     int server_depth;
     const char *output;         /* Set via xorg.conf option "Output" */
-    unsigned char *fb_data;     /* only used when host bpp != server bpp */
-    xcb_shm_segment_info_t shminfo;
+    unsigned char *fb_data;     /* only used when host bpp != server bpp
+                                   or with several SHM buffers */
+
+    /* XImages the host reads from; the back buffer is the one the next
+     * frame will be copied into when there are several SHM buffers */
+    EphyrHostBuffer buffers[EPHYR_MAX_SHM_BUFFERS];
+    int n_buffers;
+    int back_buffer;
+    Bool threaded;              /* frames go through the presenter */
+    Bool presenter_retry;       /* a frame waits for the presenter */
+    struct _ephyrPresenter *presenter;
+
+    /* Sequence numbers of the SHM frames the host has not consumed yet,
+     * oldest first; only used for asynchronous presentation */
+    unsigned int frame_seq[EPHYR_MAX_FRAMES_IN_FLIGHT];
+    int frames_in_flight;
+
+    /* Present extension state; frames_in_flight then counts the frames
+     * still waiting for their CompleteNotify */
+    xcb_special_event_t *present_events;
+    uint32_t present_eid;
+    xcb_xfixes_region_t present_update;
+    uint32_t present_serial;
+    uint64_t present_msc;       /* MSC of the last completed frame */
+
+    /* Scroll detection: the fb as the host window last showed it, the
+     * part of that copy known to be on the window, and hash scratch */
+    unsigned char *scroll_prev;
+    unsigned char *scroll_fb;
+    int scroll_stride;
+    int scroll_cpp;
+    RegionRec scroll_known;
+    uint64_t *scroll_hashes;
+    int scroll_max_lines;
+
+    /* Hash of every tile of the fb as the host last received it, 0 when
+     * unknown; damage to tiles that still hash the same is not painted */
+    uint64_t *tile_hashes;
+    unsigned char *tile_fb;
+    int tile_stride;
+    int tile_cpp;
+    int tile_cols, tile_rows;
+
+    /* Host copy of the fb that images are put into, then copied to the
+     * window; exposures are served from it without any upload */
+    xcb_pixmap_t backing_pixmap;
+    Bool backing_valid;         /* the whole fb was put into it */
+
+    /* Host RENDER transform: the fb keeps the screen orientation and the
+     * backing pixmap is composited into the window through xform_src and
+     * xform_dst.  The directions are 0 when the host does not rotate */
+    int xform_x_dir, xform_y_dir;
+    xcb_render_picture_t xform_src;
+    xcb_render_picture_t xform_dst;
 
     ScrnInfoPtr screen;
     int mynum;                  /* Screen number */
@@ -87,6 +163,7 @@ typedef struct _ephyrScrPriv {
 
     CreateScreenResourcesProcPtr CreateScreenResources;
     CloseScreenProcPtr CloseScreen;
+    ScreenBlockHandlerProcPtr BlockHandler;
     ShadowUpdateProc update;
 
 #ifdef GLAMOR
@@ -127,6 +204,9 @@ void ephyrUnsetInternalDamage(ScreenPtr pScreen);
 Bool ephyrSetInternalDamage(ScreenPtr pScreen);
 Bool ephyrCreateColormap(ColormapPtr pmap);
 void ephyrPoll(void);
+Bool ephyrPollQueued(void);
+
+extern Bool EphyrWantMotionHistory;
 
 #ifdef RANDR
 Bool ephyrRandRGetInfo(ScreenPtr pScreen, Rotation *rotations);
@@ -57,8 +57,13 @@
 
 #define SYSCALL(call) while (((call) == -1) && (errno == EINTR))
 
-#define NUM_MOUSE_BUTTONS 6
-#define NUM_MOUSE_AXES 2
+/* Wheel buttons 4 to 7 included, then back and forward */
+#define NUM_MOUSE_BUTTONS 9
+
+/* x and y, then the vertical and horizontal scroll axes */
+#define NUM_MOUSE_AXES 4
+#define SCROLL_AXIS_VERTICAL 2
+#define SCROLL_AXIS_HORIZONTAL 3
 
 static pointer EPHYRInputPlug(pointer module, pointer options, int *errmaj, int  *errmin);
 static void EPHYRInputUnplug(pointer p);
@@ -72,8 +77,12 @@ static int _ephyr_input_init_axes(DeviceIntPtr device);
 typedef struct _EphyrInputDeviceRec {
     EphyrClientPrivatePtr clientData;
     int version;
+    ValuatorMask *valuators;    /* scratch for posting events */
 } EphyrInputDeviceRec, *EphyrInputDevicePtr;
 
+/* The device host pointer events are posted to */
+static DeviceIntPtr ephyrInputDevice;
+
 static XF86ModuleVersionInfo EPHYRInputVersionRec = {
     "ephyrinput",
     MODULEVENDORSTRING,
@@ -193,7 +202,7 @@ _ephyr_input_init_buttons(DeviceIntPtr device) {
 
     map = calloc(NUM_MOUSE_BUTTONS + 1, sizeof(CARD8));
 
-    for (i = 0; i < NUM_MOUSE_BUTTONS; i++) {
+    for (i = 0; i <= NUM_MOUSE_BUTTONS; i++) {
         map[i] = i;
     }
 
@@ -209,6 +218,8 @@ _ephyr_input_init_buttons(DeviceIntPtr device) {
 
 static int
 _ephyr_input_init_axes(DeviceIntPtr device) {
+    InputInfoPtr pInfo = device->public.devicePrivate;
+    EphyrInputDevicePtr pEphyrInput = pInfo->private;
     int i;
 
     if (!InitValuatorClassDeviceStruct(device,
@@ -220,10 +231,23 @@ _ephyr_input_init_axes(DeviceIntPtr device) {
     }
 
     for (i = 0; i < NUM_MOUSE_AXES; i++) {
-        xf86InitValuatorAxisStruct(device, i, (Atom)0, -1, -1, 1, 1, 1, Absolute);
+        xf86InitValuatorAxisStruct(device, i, (Atom)0, -1, -1, 1, 1, 1,
+                                   i < SCROLL_AXIS_VERTICAL ? Absolute : Relative);
         xf86InitValuatorDefaults(device, i);
     }
 
+    /* One unit of the scroll axes is one wheel click, the server emulates
+     * the wheel buttons for clients that do not know smooth scrolling */
+    SetScrollValuator(device, SCROLL_AXIS_VERTICAL, SCROLL_TYPE_VERTICAL,
+                      1.0, SCROLL_FLAG_PREFERRED);
+    SetScrollValuator(device, SCROLL_AXIS_HORIZONTAL, SCROLL_TYPE_HORIZONTAL,
+                      1.0, SCROLL_FLAG_NONE);
+
+    pEphyrInput->valuators = valuator_mask_new(NUM_MOUSE_AXES);
+    if (!pEphyrInput->valuators) {
+        return BadAlloc;
+    }
+
     return Success; 
 }
 
@@ -296,6 +320,11 @@ EPHYRInputControl(DeviceIntPtr device, int what) {
         device->public.on = FALSE;
         break;
     case DEVICE_CLOSE:
+        valuator_mask_free(&((EphyrInputDevicePtr) pInfo->private)->valuators);
+
+        if (ephyrInputDevice == device) {
+            ephyrInputDevice = NULL;
+        }
         break;
     }
 
@@ -346,6 +375,7 @@ EPHYRInputLoadDriver(EphyrClientPrivatePtr clientData) {
     pInfo = dev->public.devicePrivate;
     pEphyrInput = pInfo->private;
     pEphyrInput->clientData = clientData;
+    ephyrInputDevice = dev;
 
     /* Set our keymap to be the same as the server's */
     EPHYRInputUpdateKeymap(dev);
@@ -368,6 +398,42 @@ EPHYRInputPostMouseMotionEvent(DeviceIntPtr dev, int x, int y) {
     xf86PostMotionEvent(dev, TRUE, 0, 2, x, y);
 }
 
+/* Posts an absolute position that keeps the fraction of a pixel */
+void
+EPHYRInputPostSubpixelMotionEvent(DeviceIntPtr dev, double x, double y) {
+    InputInfoPtr pInfo = dev->public.devicePrivate;
+    ValuatorMask *mask = ((EphyrInputDevicePtr) pInfo->private)->valuators;
+
+    valuator_mask_zero(mask);
+    valuator_mask_set_double(mask, 0, x);
+    valuator_mask_set_double(mask, 1, y);
+    xf86PostMotionEventM(dev, Absolute, mask);
+}
+
+/* Posts a scroll of dx and dy wheel clicks, which may be fractional */
+void
+EPHYRInputPostScrollEvent(DeviceIntPtr dev, double dx, double dy) {
+    InputInfoPtr pInfo = dev->public.devicePrivate;
+    ValuatorMask *mask = ((EphyrInputDevicePtr) pInfo->private)->valuators;
+
+    valuator_mask_zero(mask);
+
+    if (dy != 0) {
+        valuator_mask_set_double(mask, SCROLL_AXIS_VERTICAL, dy);
+    }
+
+    if (dx != 0) {
+        valuator_mask_set_double(mask, SCROLL_AXIS_HORIZONTAL, dx);
+    }
+
+    xf86PostMotionEventM(dev, Relative, mask);
+}
+
+DeviceIntPtr
+EPHYRInputGetDevice(void) {
+    return ephyrInputDevice;
+}
+
 void
 EPHYRInputPostButtonEvent(DeviceIntPtr dev, int button, int isDown) {
     xf86PostButtonEvent(dev, 0, button, isDown, 0, 0);
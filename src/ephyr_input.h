@@ -34,13 +34,18 @@
 #include "xf86Xinput.h"
 
 /* Loads the ephyr input driver. */
-void EphyrInputLoadDriver(EphyrClientPrivatePtr clientData);
+void EPHYRInputLoadDriver(EphyrClientPrivatePtr clientData);
 
 /* Driver init functions. */
-int EphyrInputPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
-void EphyrInputUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
+int EPHYRInputPreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
+void EPHYRInputUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
+
+/* The loaded device, NULL until then. */
+DeviceIntPtr EPHYRInputGetDevice(void);
 
 /* Input event posting functions. */
-void EphyrInputPostMouseMotionEvent(DeviceIntPtr dev, int x, int y);
-void EphyrInputPostButtonEvent(DeviceIntPtr dev, int button, int isDown);
-void EphyrInputPostKeyboardEvent(DeviceIntPtr dev, unsigned int keycode, int isDown);
+void EPHYRInputPostMouseMotionEvent(DeviceIntPtr dev, int x, int y);
+void EPHYRInputPostSubpixelMotionEvent(DeviceIntPtr dev, double x, double y);
+void EPHYRInputPostScrollEvent(DeviceIntPtr dev, double dx, double dy);
+void EPHYRInputPostButtonEvent(DeviceIntPtr dev, int button, int isDown);
+void EPHYRInputPostKeyboardEvent(DeviceIntPtr dev, unsigned int keycode, int isDown);
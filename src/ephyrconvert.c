@@ -0,0 +1,221 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ephyrconvert.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+#define EPHYR_CONVERT_SSE2
+#define EPHYR_CONVERT_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define EPHYR_CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*EphyrRGB565RowProc) (uint32_t *dst, const uint16_t *src,
+                                    int width, int swap);
+
+static EphyrRGB565RowProc rgb565_row;
+
+static inline uint32_t
+ephyr_swap32(uint32_t pixel) {
+    return (pixel >> 24) | ((pixel >> 8) & 0xff00) |
+           ((pixel << 8) & 0xff0000) | (pixel << 24);
+}
+
+/* Same expansion as the old per-pixel code: low bits are left at zero */
+static inline uint32_t
+ephyr_rgb565_to_xrgb(uint16_t pixel) {
+    return ((pixel & 0xf800) << 8) | ((pixel & 0x07e0) << 5) |
+           ((pixel & 0x001f) << 3);
+}
+
+static void
+rgb565_row_c(uint32_t *dst, const uint16_t *src, int width, int swap) {
+    int x;
+
+    if (swap) {
+        for (x = 0; x < width; x++) {
+            dst[x] = ephyr_swap32(ephyr_rgb565_to_xrgb(src[x]));
+        }
+    } else {
+        for (x = 0; x < width; x++) {
+            dst[x] = ephyr_rgb565_to_xrgb(src[x]);
+        }
+    }
+}
+
+/*
+ * The vector kernels split 16-bit lanes into r, g and b bytes, then
+ * interleave two 16-bit halves into each 32-bit pixel: (g << 8 | b) and
+ * r for XRGB, (r << 8) and (b << 8 | g) for the byte swapped version.
+ */
+
+#ifdef EPHYR_CONVERT_SSE2
+static void
+rgb565_row_sse2(uint32_t *dst, const uint16_t *src, int width, int swap) {
+    const __m128i mask_rb = _mm_set1_epi16(0xf8);
+    const __m128i mask_g = _mm_set1_epi16(0xfc);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *) (src + x));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 8), mask_rb);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 3), mask_g);
+        __m128i b = _mm_and_si128(_mm_slli_epi16(p, 3), mask_rb);
+        __m128i lo, hi;
+
+        if (swap) {
+            lo = _mm_slli_epi16(r, 8);
+            hi = _mm_or_si128(_mm_slli_epi16(b, 8), g);
+        } else {
+            lo = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+            hi = r;
+        }
+
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_unpacklo_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *) (dst + x + 4),
+                         _mm_unpackhi_epi16(lo, hi));
+    }
+
+    rgb565_row_c(dst + x, src + x, width - x, swap);
+}
+#endif
+
+#ifdef EPHYR_CONVERT_AVX2
+__attribute__((target("avx2")))
+static void
+rgb565_row_avx2(uint32_t *dst, const uint16_t *src, int width, int swap) {
+    const __m256i mask_rb = _mm256_set1_epi16(0xf8);
+    const __m256i mask_g = _mm256_set1_epi16(0xfc);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *) (src + x));
+        __m256i r = _mm256_and_si256(_mm256_srli_epi16(p, 8), mask_rb);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(p, 3), mask_g);
+        __m256i b = _mm256_and_si256(_mm256_slli_epi16(p, 3), mask_rb);
+        __m256i lo, hi, first, second;
+
+        if (swap) {
+            lo = _mm256_slli_epi16(r, 8);
+            hi = _mm256_or_si256(_mm256_slli_epi16(b, 8), g);
+        } else {
+            lo = _mm256_or_si256(_mm256_slli_epi16(g, 8), b);
+            hi = r;
+        }
+
+        /* Unpacking works per 128-bit lane, put the pixels back in order */
+        first = _mm256_unpacklo_epi16(lo, hi);
+        second = _mm256_unpackhi_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *) (dst + x),
+                            _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + x + 8),
+                            _mm256_permute2x128_si256(first, second, 0x31));
+    }
+
+    rgb565_row_c(dst + x, src + x, width - x, swap);
+}
+#endif
+
+#ifdef EPHYR_CONVERT_NEON
+static void
+rgb565_row_neon(uint32_t *dst, const uint16_t *src, int width, int swap) {
+    const uint16x8_t mask_rb = vdupq_n_u16(0xf8);
+    const uint16x8_t mask_g = vdupq_n_u16(0xfc);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        uint16x8_t p = vld1q_u16(src + x);
+        uint16x8_t r = vandq_u16(vshrq_n_u16(p, 8), mask_rb);
+        uint16x8_t g = vandq_u16(vshrq_n_u16(p, 3), mask_g);
+        uint16x8_t b = vandq_u16(vshlq_n_u16(p, 3), mask_rb);
+        uint16x8x2_t pixels;
+
+        if (swap) {
+            pixels = vzipq_u16(vshlq_n_u16(r, 8),
+                               vorrq_u16(vshlq_n_u16(b, 8), g));
+        } else {
+            pixels = vzipq_u16(vorrq_u16(vshlq_n_u16(g, 8), b), r);
+        }
+
+        vst1q_u32(dst + x, vreinterpretq_u32_u16(pixels.val[0]));
+        vst1q_u32(dst + x + 4, vreinterpretq_u32_u16(pixels.val[1]));
+    }
+
+    rgb565_row_c(dst + x, src + x, width - x, swap);
+}
+#endif
+
+void
+ephyr_convert_init(void) {
+    rgb565_row = rgb565_row_c;
+
+#ifdef EPHYR_CONVERT_SSE2
+    rgb565_row = rgb565_row_sse2;
+#endif
+
+#ifdef EPHYR_CONVERT_AVX2
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        rgb565_row = rgb565_row_avx2;
+    }
+#endif
+
+#ifdef EPHYR_CONVERT_NEON
+    rgb565_row = rgb565_row_neon;
+#endif
+}
+
+void
+ephyr_convert_rgb565_row(uint32_t *dst, const uint16_t *src, int width,
+                         int swap) {
+    rgb565_row(dst, src, width, swap);
+}
+
+/*
+ * Palette lookups do not vectorize (AVX2 gathers are slower than scalar
+ * loads here), so this is a plain loop the compiler is free to unroll.
+ */
+void
+ephyr_convert_pal8_row(uint32_t *dst, const uint8_t *src, int width,
+                       const unsigned long *cmap, int swap) {
+    int x;
+
+    if (swap) {
+        for (x = 0; x < width; x++) {
+            dst[x] = ephyr_swap32(cmap[src[x]]);
+        }
+    } else {
+        for (x = 0; x < width; x++) {
+            dst[x] = cmap[src[x]];
+        }
+    }
+}
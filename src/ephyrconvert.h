@@ -0,0 +1,46 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRCONVERT_H_
+#define _EPHYRCONVERT_H_
+
+#include <stdint.h>
+
+/*
+ * Row converters from the server framebuffer formats to 32bpp XRGB host
+ * images, used when the host depth does not match the server one.  The
+ * source is always in native byte order; swap asks for the destination
+ * pixels to be byte swapped, for hosts of the other endianness.
+ *
+ * The best implementation for the CPU (AVX2, SSE2, NEON or plain C) is
+ * picked by ephyr_convert_init(), which must run once before any
+ * converter, and before the threads that call them are started.
+ */
+
+void ephyr_convert_init(void);
+
+void ephyr_convert_rgb565_row(uint32_t *dst, const uint16_t *src, int width,
+                              int swap);
+
+void ephyr_convert_pal8_row(uint32_t *dst, const uint8_t *src, int width,
+                            const unsigned long *cmap, int swap);
+
+#endif /* _EPHYRCONVERT_H_ */
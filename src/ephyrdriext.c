@@ -55,6 +55,7 @@
 #include "ephyrdri.h"
 #include "ephyrdriext.h"
 #include "hostx.h"
+#include "ephyrwindows.h"
 #define _HAVE_XALLOC_DECLS
 #include "ephyrlog.h"
 #include "protocol-versions.h"
@@ -808,6 +809,7 @@ appendWindowPairToList(WindowPtr a_local, int a_remote)
         if (window_pairs[i].local == NULL) {
             window_pairs[i].local = a_local;
             window_pairs[i].remote = a_remote;
+            ephyr_window_set_pair(a_remote, &window_pairs[i]);
             return TRUE;
         }
     }
@@ -902,6 +904,8 @@ destroyHostPeerWindow(const WindowPtr a_win)
         goto out;
     }
     hostx_destroy_window(pair->remote);
+    pair->local = NULL;
+    pair->remote = 0;
     is_ok = TRUE;
 
  out:
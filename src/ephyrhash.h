@@ -0,0 +1,104 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRHASH_H_
+#define _EPHYRHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Fast non-cryptographic hashing of framebuffer contents, used to find
+ * out which parts of a frame match the previous one.  Collisions only
+ * cost a wrong match, so speed matters more than quality here.
+ */
+
+#define EPHYR_HASH_PRIME 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t
+ephyr_hash_mix(uint64_t hash, uint64_t value) {
+    hash ^= value;
+    hash *= EPHYR_HASH_PRIME;
+    return hash ^ (hash >> 29);
+}
+
+static inline uint64_t
+ephyr_hash_bytes(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = len * EPHYR_HASH_PRIME;
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        hash = ephyr_hash_mix(hash, word);
+    }
+
+    if (len) {
+        word = 0;
+        memcpy(&word, p, len);
+        hash = ephyr_hash_mix(hash, word);
+    }
+
+    return hash;
+}
+
+/*
+ * Hashes height rows of len bytes each, stride bytes apart.  As in xxHash,
+ * four lanes are mixed independently so that consecutive words do not
+ * wait on each other and the compiler is free to vectorize the loop.
+ */
+static inline uint64_t
+ephyr_hash_block(const void *data, size_t len, int height, size_t stride) {
+    const unsigned char *row = data;
+    uint64_t lanes[4] = {
+        EPHYR_HASH_PRIME, 2 * EPHYR_HASH_PRIME,
+        3 * EPHYR_HASH_PRIME, 4 * EPHYR_HASH_PRIME
+    };
+    uint64_t hash = (len * height) * EPHYR_HASH_PRIME;
+    uint64_t words[4];
+    int y, i;
+
+    for (y = 0; y < height; y++, row += stride) {
+        const unsigned char *p = row;
+        size_t left = len;
+
+        for (; left >= sizeof(words);
+             left -= sizeof(words), p += sizeof(words)) {
+            memcpy(words, p, sizeof(words));
+            for (i = 0; i < 4; i++) {
+                lanes[i] = ephyr_hash_mix(lanes[i], words[i]);
+            }
+        }
+
+        if (left) {
+            lanes[0] = ephyr_hash_mix(lanes[0], ephyr_hash_bytes(p, left));
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        hash = ephyr_hash_mix(hash, lanes[i]);
+    }
+
+    return hash;
+}
+
+#endif /* _EPHYRHASH_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <xcb/xcb_aux.h>
+
+#include "ephyrpresenter.h"
+
+struct _ephyrPresenter {
+    xcb_connection_t *conn;
+    xcb_gcontext_t gc;
+    pthread_t thread;
+    sem_t wakeup;               /* posted for every frame, and to quit */
+    int quit;
+    int done_fds[2];            /* readable once frames were presented */
+
+    /* head is only written by the main thread and tail by the presenter,
+     * each of them publishing the frames it is done with */
+    EphyrPresentFrame frames[EPHYR_PRESENTER_QUEUE];
+    unsigned int head;
+    unsigned int tail;
+};
+
+/**
+ * Puts every box of a frame and waits for the host to have processed
+ * them before handing the SHM buffer back.  Segments and windows are
+ * looked up by id on the host, so the ones of the main connection can be
+ * used from ours.
+ */
+static void
+ephyr_presenter_present(EphyrPresenter *presenter, EphyrPresentFrame *frame) {
+    xcb_generic_event_t *event;
+    int i;
+
+    for (i = 0; i < frame->n_boxes; i++) {
+        BoxPtr box = &frame->boxes[i];
+
+        xcb_shm_put_image(presenter->conn, frame->window, presenter->gc,
+                          frame->image_width, frame->image_height,
+                          box->x1, box->y1,
+                          box->x2 - box->x1, box->y2 - box->y1,
+                          box->x1, box->y1,
+                          frame->depth, XCB_IMAGE_FORMAT_Z_PIXMAP, FALSE,
+                          frame->shmseg, frame->offset);
+    }
+
+    xcb_aux_sync(presenter->conn);
+
+    /* Nothing selects events here, only errors could be queued */
+    while ((event = xcb_poll_for_event(presenter->conn))) {
+        free(event);
+    }
+
+    free(frame->boxes);
+    __atomic_store_n(frame->busy, FALSE, __ATOMIC_RELEASE);
+}
+
+static void *
+ephyr_presenter_thread(void *arg) {
+    EphyrPresenter *presenter = arg;
+
+    for (;;) {
+        unsigned int tail = presenter->tail;
+
+        while (sem_wait(&presenter->wakeup) < 0 && errno == EINTR) {
+            ;
+        }
+
+        if (__atomic_load_n(&presenter->quit, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        while (tail != __atomic_load_n(&presenter->head, __ATOMIC_ACQUIRE)) {
+            ephyr_presenter_present(presenter,
+                &presenter->frames[tail % EPHYR_PRESENTER_QUEUE]);
+            tail++;
+            __atomic_store_n(&presenter->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        /* A full pipe is already readable, so a failed write is fine */
+        if (write(presenter->done_fds[1], "", 1) < 0) {
+            ;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens a new connection to the host display and starts a presenter
+ * thread on it, which blocks every signal like the presentation workers.
+ * Returns NULL on failure.
+ */
+EphyrPresenter *
+ephyr_presenter_create(void) {
+    EphyrPresenter *presenter;
+    const xcb_setup_t *setup;
+    xcb_screen_iterator_t it;
+    sigset_t all, saved;
+    int screen, ret;
+
+    presenter = calloc(1, sizeof(EphyrPresenter));
+
+    if (!presenter) {
+        return NULL;
+    }
+
+    if (pipe(presenter->done_fds) < 0) {
+        free(presenter);
+        return NULL;
+    }
+
+    fcntl(presenter->done_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(presenter->done_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(presenter->done_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(presenter->done_fds[1], F_SETFD, FD_CLOEXEC);
+
+    presenter->conn = xcb_connect(NULL, &screen);
+
+    if (xcb_connection_has_error(presenter->conn)) {
+        goto fail;
+    }
+
+    setup = xcb_get_setup(presenter->conn);
+    it = xcb_setup_roots_iterator(setup);
+
+    while (screen-- > 0 && it.rem) {
+        xcb_screen_next(&it);
+    }
+
+    presenter->gc = xcb_generate_id(presenter->conn);
+    xcb_create_gc(presenter->conn, presenter->gc, it.data->root, 0, NULL);
+
+    if (sem_init(&presenter->wakeup, 0, 0) < 0) {
+        goto fail;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    ret = pthread_create(&presenter->thread, NULL,
+                         ephyr_presenter_thread, presenter);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (ret != 0) {
+        sem_destroy(&presenter->wakeup);
+        goto fail;
+    }
+
+    return presenter;
+
+ fail:
+    xcb_disconnect(presenter->conn);
+    close(presenter->done_fds[0]);
+    close(presenter->done_fds[1]);
+    free(presenter);
+    return NULL;
+}
+
+/**
+ * Stops the presenter once it presented every queued frame.
+ */
+void
+ephyr_presenter_destroy(EphyrPresenter *presenter) {
+    if (!presenter) {
+        return;
+    }
+
+    /* Frames still in the ring come before the request to quit */
+    while (__atomic_load_n(&presenter->tail, __ATOMIC_ACQUIRE) !=
+           presenter->head) {
+        sched_yield();
+    }
+
+    __atomic_store_n(&presenter->quit, TRUE, __ATOMIC_RELEASE);
+    sem_post(&presenter->wakeup);
+    pthread_join(presenter->thread, NULL);
+
+    sem_destroy(&presenter->wakeup);
+    xcb_disconnect(presenter->conn);
+    close(presenter->done_fds[0]);
+    close(presenter->done_fds[1]);
+    free(presenter);
+}
+
+/**
+ * Returns a descriptor that becomes readable whenever the presenter has
+ * handed buffers back or made room in its ring.
+ */
+int
+ephyr_presenter_get_fd(EphyrPresenter *presenter) {
+    return presenter->done_fds[0];
+}
+
+/**
+ * Empties the descriptor of ephyr_presenter_get_fd() once it was seen
+ * readable.
+ */
+void
+ephyr_presenter_clear_fd(EphyrPresenter *presenter) {
+    char buf[64];
+
+    while (read(presenter->done_fds[0], buf, sizeof(buf)) > 0) {
+        ;
+    }
+}
+
+/**
+ * Queues a frame for the presenter.  Returns FALSE without waiting when
+ * the ring is full, in which case the frame still belongs to the caller.
+ */
+Bool
+ephyr_presenter_push(EphyrPresenter *presenter,
+                     const EphyrPresentFrame *frame) {
+    unsigned int head = presenter->head;
+
+    if (head - __atomic_load_n(&presenter->tail, __ATOMIC_ACQUIRE) >=
+        EPHYR_PRESENTER_QUEUE) {
+        return FALSE;
+    }
+
+    presenter->frames[head % EPHYR_PRESENTER_QUEUE] = *frame;
+    __atomic_store_n(&presenter->head, head + 1, __ATOMIC_RELEASE);
+    sem_post(&presenter->wakeup);
+
+    return TRUE;
+}
@@ -0,0 +1,66 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRPRESENTER_H_
+#define _EPHYRPRESENTER_H_
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include "misc.h"
+#include "miscstruct.h"
+
+/*
+ * A thread that puts frames on the host over a connection of its own, so
+ * that the server never waits on the host socket.  Every screen gets one,
+ * and screens upload concurrently.  The main thread hands frames over
+ * through a single producer, single consumer ring, which holds up to
+ * EPHYR_PRESENTER_QUEUE of them, and hears back through a pipe the server
+ * watches.
+ */
+#define EPHYR_PRESENTER_QUEUE 8
+
+typedef struct _ephyrPresenter EphyrPresenter;
+
+typedef struct _ephyrPresentFrame {
+    xcb_window_t window;
+    xcb_shm_seg_t shmseg;       /* attached by the main connection */
+    uint32_t offset;
+    uint16_t image_width;
+    uint16_t image_height;
+    uint8_t depth;
+    BoxPtr boxes;               /* freed once the frame is presented */
+    int n_boxes;
+    int *busy;                  /* cleared once the host read the image */
+} EphyrPresentFrame;
+
+EphyrPresenter *ephyr_presenter_create(void);
+
+void ephyr_presenter_destroy(EphyrPresenter *presenter);
+
+Bool ephyr_presenter_push(EphyrPresenter *presenter,
+                          const EphyrPresentFrame *frame);
+
+int ephyr_presenter_get_fd(EphyrPresenter *presenter);
+
+void ephyr_presenter_clear_fd(EphyrPresenter *presenter);
+
+#endif /* _EPHYRPRESENTER_H_ */
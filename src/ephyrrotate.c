@@ -0,0 +1,309 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#include "ephyrrotate.h"
+
+#if defined(__SSE2__)
+#define EPHYR_ROTATE_SSE2
+#include <emmintrin.h>
+#endif
+
+void
+ephyr_rotation_dirs(int randr, int *x_dir, int *y_dir) {
+    int o_x_dir = EPHYR_LEFT_TO_RIGHT, o_y_dir = EPHYR_TOP_TO_BOTTOM;
+
+    /* Reflections flip the shadow axes first, then the rotation tells
+     * along which of them each host fb axis runs */
+    if (randr & RR_Reflect_X) {
+        o_x_dir = -o_x_dir;
+    }
+
+    if (randr & RR_Reflect_Y) {
+        o_y_dir = -o_y_dir;
+    }
+
+    switch (randr & (RR_Rotate_0 | RR_Rotate_90 |
+                     RR_Rotate_180 | RR_Rotate_270)) {
+    case RR_Rotate_0:
+    default:
+        *x_dir = o_x_dir;
+        *y_dir = o_y_dir;
+        break;
+    case RR_Rotate_90:
+        *x_dir = o_y_dir;
+        *y_dir = -o_x_dir;
+        break;
+    case RR_Rotate_180:
+        *x_dir = -o_x_dir;
+        *y_dir = -o_y_dir;
+        break;
+    case RR_Rotate_270:
+        *x_dir = -o_y_dir;
+        *y_dir = o_x_dir;
+        break;
+    }
+}
+
+static int
+ephyr_rotate_axis(int dir, const BoxRec *box, int width, int height,
+                  short *end) {
+    switch (dir) {
+    case EPHYR_LEFT_TO_RIGHT:
+        *end = box->x2;
+        return box->x1;
+    case EPHYR_RIGHT_TO_LEFT:
+        *end = width - box->x1;
+        return width - box->x2;
+    case EPHYR_TOP_TO_BOTTOM:
+        *end = box->y2;
+        return box->y1;
+    default:
+        *end = height - box->y1;
+        return height - box->y2;
+    }
+}
+
+void
+ephyr_rotate_box(int x_dir, int y_dir, int width, int height,
+                 const BoxRec *box, BoxPtr out) {
+    BoxRec in = *box;
+
+    out->x1 = ephyr_rotate_axis(x_dir, &in, width, height, &out->x2);
+    out->y1 = ephyr_rotate_axis(y_dir, &in, width, height, &out->y2);
+}
+
+/*
+ * A shadow pixel is found at src + X * step_x + Y * step_y for host fb
+ * coordinates (X, Y).  When the host x axis follows shadow columns, one
+ * of the steps is a whole stride and the copy is a transpose: it is done
+ * in square tiles so that both sides stay in cache, with SIMD transposes
+ * of 4x4 (32 bpp) or 8x8 (16 bpp) blocks inside of them.
+ */
+#define EPHYR_ROTATE_TILE 32
+
+static void
+ephyr_rotate_scalar(uint8_t *dst, int dst_stride, const uint8_t *src,
+                    ptrdiff_t step_x, ptrdiff_t step_y, int cpp,
+                    int x, int y, int width, int height) {
+    int i, j;
+
+    for (j = y; j < y + height; j++) {
+        const uint8_t *s = src + x * step_x + j * step_y;
+
+        if (step_x == cpp) {
+            memcpy(dst + j * dst_stride + x * cpp, s, width * cpp);
+        } else if (cpp == 4) {
+            uint32_t *d = (uint32_t *) (dst + j * dst_stride) + x;
+
+            for (i = 0; i < width; i++, s += step_x) {
+                d[i] = *(const uint32_t *) s;
+            }
+        } else {
+            uint16_t *d = (uint16_t *) (dst + j * dst_stride) + x;
+
+            for (i = 0; i < width; i++, s += step_x) {
+                d[i] = *(const uint16_t *) s;
+            }
+        }
+    }
+}
+
+#ifdef EPHYR_ROTATE_SSE2
+/* Loads n pixels along the y axis, first one first */
+static inline __m128i
+ephyr_load_column32(const uint8_t *s, ptrdiff_t step_y) {
+    if (step_y > 0) {
+        return _mm_loadu_si128((const __m128i *) s);
+    }
+
+    return _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (s - 12)),
+                             _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+static inline __m128i
+ephyr_load_column16(const uint8_t *s, ptrdiff_t step_y) {
+    __m128i v;
+
+    if (step_y > 0) {
+        return _mm_loadu_si128((const __m128i *) s);
+    }
+
+    v = _mm_loadu_si128((const __m128i *) (s - 14));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+static void
+ephyr_transpose_block32(uint8_t *dst, int dst_stride, const uint8_t *src,
+                        ptrdiff_t step_x, ptrdiff_t step_y, int x, int y) {
+    const uint8_t *s = src + x * step_x + y * step_y;
+    __m128i r0 = ephyr_load_column32(s, step_y);
+    __m128i r1 = ephyr_load_column32(s + step_x, step_y);
+    __m128i r2 = ephyr_load_column32(s + 2 * step_x, step_y);
+    __m128i r3 = ephyr_load_column32(s + 3 * step_x, step_y);
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    uint8_t *d = dst + y * dst_stride + x * 4;
+
+    _mm_storeu_si128((__m128i *) d, _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) (d + dst_stride),
+                     _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *) (d + 2 * dst_stride),
+                     _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *) (d + 3 * dst_stride),
+                     _mm_unpackhi_epi64(t2, t3));
+}
+
+static void
+ephyr_transpose_block16(uint8_t *dst, int dst_stride, const uint8_t *src,
+                        ptrdiff_t step_x, ptrdiff_t step_y, int x, int y) {
+    const uint8_t *s = src + x * step_x + y * step_y;
+    uint8_t *d = dst + y * dst_stride + x * 2;
+    __m128i r[8], p[8], q[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        r[i] = ephyr_load_column16(s + i * step_x, step_y);
+    }
+
+    /* Pairs of rows, pixels 0-3 then 4-7 */
+    for (i = 0; i < 4; i++) {
+        p[i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+        p[i + 4] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
+    }
+
+    /* Rows 0-3 then 4-7, two pixels each */
+    q[0] = _mm_unpacklo_epi32(p[0], p[1]);
+    q[1] = _mm_unpackhi_epi32(p[0], p[1]);
+    q[2] = _mm_unpacklo_epi32(p[4], p[5]);
+    q[3] = _mm_unpackhi_epi32(p[4], p[5]);
+    q[4] = _mm_unpacklo_epi32(p[2], p[3]);
+    q[5] = _mm_unpackhi_epi32(p[2], p[3]);
+    q[6] = _mm_unpacklo_epi32(p[6], p[7]);
+    q[7] = _mm_unpackhi_epi32(p[6], p[7]);
+
+    for (i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *) (d + 2 * i * dst_stride),
+                         _mm_unpacklo_epi64(q[i], q[i + 4]));
+        _mm_storeu_si128((__m128i *) (d + (2 * i + 1) * dst_stride),
+                         _mm_unpackhi_epi64(q[i], q[i + 4]));
+    }
+}
+#endif
+
+/**
+ * Transposing copy of one tile: whole SIMD blocks first, then what is
+ * left on the right and bottom edges pixel by pixel.
+ */
+static void
+ephyr_rotate_tile(uint8_t *dst, int dst_stride, const uint8_t *src,
+                  ptrdiff_t step_x, ptrdiff_t step_y, int cpp,
+                  int x, int y, int width, int height) {
+#ifdef EPHYR_ROTATE_SSE2
+    int block = cpp == 4 ? 4 : 8;
+    int block_width = width - width % block;
+    int block_height = height - height % block;
+    int bx, by;
+
+    for (by = y; by < y + block_height; by += block) {
+        for (bx = x; bx < x + block_width; bx += block) {
+            if (cpp == 4) {
+                ephyr_transpose_block32(dst, dst_stride, src,
+                                        step_x, step_y, bx, by);
+            } else {
+                ephyr_transpose_block16(dst, dst_stride, src,
+                                        step_x, step_y, bx, by);
+            }
+        }
+    }
+
+    ephyr_rotate_scalar(dst, dst_stride, src, step_x, step_y, cpp,
+                        x + block_width, y, width - block_width, block_height);
+    ephyr_rotate_scalar(dst, dst_stride, src, step_x, step_y, cpp,
+                        x, y + block_height, width, height - block_height);
+#else
+    ephyr_rotate_scalar(dst, dst_stride, src, step_x, step_y, cpp,
+                        x, y, width, height);
+#endif
+}
+
+/* Step between shadow pixels along dir, moving origin to the first one */
+static ptrdiff_t
+ephyr_rotate_step(int dir, int cpp, int stride, int width, int height,
+                  const uint8_t **origin) {
+    switch (dir) {
+    case EPHYR_LEFT_TO_RIGHT:
+        return cpp;
+    case EPHYR_RIGHT_TO_LEFT:
+        *origin += (ptrdiff_t) (width - 1) * cpp;
+        return -cpp;
+    case EPHYR_TOP_TO_BOTTOM:
+        return stride;
+    default:
+        *origin += (ptrdiff_t) (height - 1) * stride;
+        return -stride;
+    }
+}
+
+Bool
+ephyr_rotate_rect(uint8_t *dst, int dst_stride,
+                  const uint8_t *src, int src_stride, int bpp,
+                  int x_dir, int y_dir, int sha_width, int sha_height,
+                  int x, int y, int width, int height) {
+    int tx, ty, cpp = bpp >> 3;
+    ptrdiff_t step_x, step_y;
+
+    if (bpp != 16 && bpp != 32) {
+        return FALSE;
+    }
+
+    step_x = ephyr_rotate_step(x_dir, cpp, src_stride,
+                               sha_width, sha_height, &src);
+    step_y = ephyr_rotate_step(y_dir, cpp, src_stride,
+                               sha_width, sha_height, &src);
+
+    /* Reflections and 180 degrees keep rows as rows */
+    if (step_x == cpp || step_x == -cpp) {
+        ephyr_rotate_scalar(dst, dst_stride, src, step_x, step_y, cpp,
+                            x, y, width, height);
+        return TRUE;
+    }
+
+    for (ty = y; ty < y + height; ty += EPHYR_ROTATE_TILE) {
+        for (tx = x; tx < x + width; tx += EPHYR_ROTATE_TILE) {
+            ephyr_rotate_tile(dst, dst_stride, src, step_x, step_y, cpp, tx, ty,
+                              min(EPHYR_ROTATE_TILE, x + width - tx),
+                              min(EPHYR_ROTATE_TILE, y + height - ty));
+        }
+    }
+
+    return TRUE;
+}
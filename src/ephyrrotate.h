@@ -0,0 +1,62 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRROTATE_H_
+#define _EPHYRROTATE_H_
+
+#include <stdint.h>
+#include <X11/extensions/randr.h>
+#include "misc.h"
+#include "miscstruct.h"
+
+/* Directions in which the shadow is walked along the host fb axes,
+ * with the same conventions as shadowUpdateRotatePacked() */
+#define EPHYR_LEFT_TO_RIGHT  1
+#define EPHYR_RIGHT_TO_LEFT -1
+#define EPHYR_TOP_TO_BOTTOM  2
+#define EPHYR_BOTTOM_TO_TOP -2
+
+/*
+ * Sets the directions in which the host fb axes run through a shadow
+ * rotated and reflected by randr (a combination of RR_Rotate_* and
+ * RR_Reflect_* bits).
+ */
+void ephyr_rotation_dirs(int randr, int *x_dir, int *y_dir);
+
+/*
+ * Maps box, in the coordinates of a width x height shadow, to the host
+ * fb box it is shown in when walked in the x_dir and y_dir directions.
+ */
+void ephyr_rotate_box(int x_dir, int y_dir, int width, int height,
+                      const BoxRec *box, BoxPtr out);
+
+/*
+ * Copies the rectangle (x, y, width, height) of the host framebuffer dst
+ * from a shadow of sha_width x sha_height pixels, walked in the x_dir
+ * and y_dir directions.  Handles 16 and 32 bpp only, and returns FALSE
+ * for anything else.
+ */
+Bool ephyr_rotate_rect(uint8_t *dst, int dst_stride,
+                       const uint8_t *src, int src_stride, int bpp,
+                       int x_dir, int y_dir, int sha_width, int sha_height,
+                       int x, int y, int width, int height);
+
+#endif /* _EPHYRROTATE_H_ */
@@ -0,0 +1,180 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ephyrwindows.h"
+
+/* Slots the table starts with; it doubles whenever it gets half full */
+#define EPHYR_WINDOWS_MIN_SIZE 16
+
+static EphyrHostWindow *windows;
+static unsigned int windows_size;       /* a power of two */
+static unsigned int windows_count;
+
+static unsigned int
+ephyr_window_slot(xcb_window_t window) {
+    /* Ids are handed out in sequence, spread them over the table */
+    return (uint32_t) (window * 0x9e3779b1u) & (windows_size - 1);
+}
+
+static EphyrHostWindow *
+ephyr_window_find(xcb_window_t window) {
+    unsigned int i;
+
+    if (!windows_size) {
+        return NULL;
+    }
+
+    for (i = ephyr_window_slot(window); windows[i].window != XCB_WINDOW_NONE;
+         i = (i + 1) & (windows_size - 1)) {
+        if (windows[i].window == window) {
+            return &windows[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+ephyr_window_insert(const EphyrHostWindow *entry) {
+    unsigned int i = ephyr_window_slot(entry->window);
+
+    while (windows[i].window != XCB_WINDOW_NONE) {
+        i = (i + 1) & (windows_size - 1);
+    }
+
+    windows[i] = *entry;
+    windows_count++;
+}
+
+static Bool
+ephyr_window_grow(void) {
+    EphyrHostWindow *old = windows;
+    unsigned int old_size = windows_size, i;
+    unsigned int size = old_size ? old_size * 2 : EPHYR_WINDOWS_MIN_SIZE;
+
+    /* XCB_WINDOW_NONE is 0, so calloc gives free slots */
+    windows = calloc(size, sizeof(EphyrHostWindow));
+    if (!windows) {
+        windows = old;
+        return FALSE;
+    }
+
+    windows_size = size;
+    windows_count = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].window != XCB_WINDOW_NONE) {
+            ephyr_window_insert(&old[i]);
+        }
+    }
+
+    free(old);
+    return TRUE;
+}
+
+/**
+ * Makes events of window map to the screen of scrpriv.  Registering a
+ * window again moves it to that screen.
+ */
+Bool
+ephyr_window_register(xcb_window_t window, struct _ephyrScrPriv *scrpriv) {
+    EphyrHostWindow *found = ephyr_window_find(window);
+    EphyrHostWindow entry = { window, scrpriv, NULL };
+
+    if (window == XCB_WINDOW_NONE) {
+        return FALSE;
+    }
+
+    if (found) {
+        found->scrpriv = scrpriv;
+        return TRUE;
+    }
+
+    if (2 * (windows_count + 1) > windows_size && !ephyr_window_grow()) {
+        return FALSE;
+    }
+
+    ephyr_window_insert(&entry);
+    return TRUE;
+}
+
+/**
+ * Records the DRI window pair a registered peer window belongs to.
+ */
+void
+ephyr_window_set_pair(xcb_window_t window, void *pair) {
+    EphyrHostWindow *found = ephyr_window_find(window);
+
+    if (found) {
+        found->pair = pair;
+    }
+}
+
+void
+ephyr_window_unregister(xcb_window_t window) {
+    EphyrHostWindow *found = ephyr_window_find(window);
+    unsigned int hole, i;
+
+    if (!found) {
+        return;
+    }
+
+    /* Shift back the entries of the probe sequence that went past the
+     * freed slot, so that lookups never need to skip holes */
+    hole = found - windows;
+    windows[hole].window = XCB_WINDOW_NONE;
+    windows_count--;
+
+    for (i = (hole + 1) & (windows_size - 1);
+         windows[i].window != XCB_WINDOW_NONE;
+         i = (i + 1) & (windows_size - 1)) {
+        unsigned int slot = ephyr_window_slot(windows[i].window);
+
+        /* Entries whose home slot lies cyclically in (hole, i] stay */
+        if (((i - slot) & (windows_size - 1)) <
+            ((i - hole) & (windows_size - 1))) {
+            continue;
+        }
+
+        windows[hole] = windows[i];
+        windows[i].window = XCB_WINDOW_NONE;
+        hole = i;
+    }
+}
+
+/**
+ * Returns what window belongs to, or NULL if it is not one of ours.
+ */
+const EphyrHostWindow *
+ephyr_window_lookup(xcb_window_t window) {
+    if (window == XCB_WINDOW_NONE) {
+        return NULL;
+    }
+
+    return ephyr_window_find(window);
+}
@@ -0,0 +1,49 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRWINDOWS_H_
+#define _EPHYRWINDOWS_H_
+
+#include <xcb/xcb.h>
+#include "misc.h"
+
+/*
+ * Maps the host windows we receive events for to what they belong to, so
+ * that event processing does not scan the screens for every event.  An
+ * open addressing hash table with linear probing, since there are few
+ * windows and lookups vastly outnumber changes.
+ */
+
+typedef struct _ephyrHostWindow {
+    xcb_window_t window;        /* XCB_WINDOW_NONE in free slots */
+    struct _ephyrScrPriv *scrpriv;
+    void *pair;                 /* EphyrWindowPair of DRI peer windows */
+} EphyrHostWindow;
+
+Bool ephyr_window_register(xcb_window_t window, struct _ephyrScrPriv *scrpriv);
+
+void ephyr_window_set_pair(xcb_window_t window, void *pair);
+
+void ephyr_window_unregister(xcb_window_t window);
+
+const EphyrHostWindow *ephyr_window_lookup(xcb_window_t window);
+
+#endif /* _EPHYRWINDOWS_H_ */
@@ -0,0 +1,192 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "ephyrworkers.h"
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;       /* new jobs were queued, or quit */
+    pthread_cond_t done;        /* the last job of a run finished */
+    pthread_t *threads;
+    int n_threads;
+
+    EphyrWorkProc proc;
+    void *data;
+    int n_jobs;
+    int next_job;
+    int jobs_done;
+    Bool quit;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Takes the next job of the current run and executes it, with the pool
+ * lock held on entry and exit.  Returns FALSE when there is none left.
+ */
+static Bool
+ephyr_workers_run_one(void) {
+    EphyrWorkProc proc = pool.proc;
+    void *data = pool.data;
+    int job;
+
+    if (pool.next_job >= pool.n_jobs) {
+        return FALSE;
+    }
+
+    job = pool.next_job++;
+    pthread_mutex_unlock(&pool.lock);
+    proc(data, job);
+    pthread_mutex_lock(&pool.lock);
+
+    if (++pool.jobs_done == pool.n_jobs) {
+        pthread_cond_signal(&pool.done);
+    }
+
+    return TRUE;
+}
+
+static void *
+ephyr_worker_thread(void *arg) {
+    pthread_mutex_lock(&pool.lock);
+
+    while (!pool.quit) {
+        if (!ephyr_workers_run_one()) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * Starts n_threads workers.  They block every signal, which are for the
+ * main thread of the server to handle.
+ */
+Bool
+ephyr_workers_init(int n_threads) {
+    sigset_t all, saved;
+    int i;
+
+    if (pool.n_threads || n_threads <= 0) {
+        return pool.n_threads > 0;
+    }
+
+    pool.threads = calloc(n_threads, sizeof(pthread_t));
+
+    if (!pool.threads) {
+        return FALSE;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&pool.threads[i], NULL,
+                           ephyr_worker_thread, NULL) != 0) {
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    pool.n_threads = i;
+
+    if (!pool.n_threads) {
+        free(pool.threads);
+        pool.threads = NULL;
+    }
+
+    return pool.n_threads > 0;
+}
+
+void
+ephyr_workers_fini(void) {
+    int i;
+
+    if (!pool.n_threads) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = TRUE;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.n_threads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.n_threads = 0;
+    pool.quit = FALSE;
+}
+
+int
+ephyr_workers_count(void) {
+    return pool.n_threads;
+}
+
+/**
+ * Runs proc(data, job) for every job in [0, n_jobs) on the workers and
+ * the calling thread, and returns once all of them are finished.
+ */
+void
+ephyr_workers_run(EphyrWorkProc proc, void *data, int n_jobs) {
+    int job;
+
+    if (!pool.n_threads || n_jobs <= 1) {
+        for (job = 0; job < n_jobs; job++) {
+            proc(data, job);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.proc = proc;
+    pool.data = data;
+    pool.n_jobs = n_jobs;
+    pool.next_job = 0;
+    pool.jobs_done = 0;
+    pthread_cond_broadcast(&pool.start);
+
+    while (ephyr_workers_run_one()) {
+        ;
+    }
+
+    while (pool.jobs_done < pool.n_jobs) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _EPHYRWORKERS_H_
+#define _EPHYRWORKERS_H_
+
+#include "misc.h"
+
+/*
+ * A small pool of threads used to spread CPU heavy presentation work,
+ * such as framebuffer conversion, over idle cores.  Jobs must not touch
+ * server state nor the xcb connection; the main thread issues all the
+ * protocol requests once ephyr_workers_run() returns.
+ */
+
+typedef void (*EphyrWorkProc) (void *data, int job);
+
+Bool ephyr_workers_init(int n_threads);
+
+void ephyr_workers_fini(void);
+
+int ephyr_workers_count(void);
+
+void ephyr_workers_run(EphyrWorkProc proc, void *data, int n_jobs);
+
+#endif /* _EPHYRWORKERS_H_ */
@@ -35,23 +35,33 @@
 #include <unistd.h>
 #include <string.h>             /* for memset */
 #include <errno.h>
+#include <sched.h>
 #include <time.h>
 #include <err.h>
 
+#include <fcntl.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <math.h>
 
 #include <X11/keysym.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_icccm.h>
 #include <xcb/xcb_aux.h>
 #include <xcb/shm.h>
+#include <xcb/present.h>
+#include <xcb/xfixes.h>
 #include <xcb/xcb_image.h>
+#include <xcb/xcb_renderutil.h>
 #include <xcb/shape.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/randr.h>
+#include <xcb/xinput.h>
+#include <xcb/xkb.h>
 #ifdef XF86DRI
 #include <xcb/xf86dri.h>
 #include <xcb/glx.h>
@@ -63,6 +73,23 @@
 #endif
 #include "ephyrlog.h"
 #include "ephyr.h"
+#include "ephyrconvert.h"
+#include "ephyrworkers.h"
+#include "ephyrhash.h"
+#include "ephyrrotate.h"
+#include "ephyrpresenter.h"
+#include "ephyrwindows.h"
+
+/* Scroll valuators of the host pointer we keep track of */
+#define HOSTX_MAX_SCROLL_AXES 4
+
+typedef struct {
+    uint16_t number;
+    Bool vertical;
+    double increment;           /* valuator change worth one click */
+    double last;                /* value in the last event */
+    Bool have_last;
+} HostXScrollAxis;
 
 struct EphyrHostXVars {
     char *server_dpy_name;
@@ -77,6 +104,38 @@ struct EphyrHostXVars {
     Bool use_sw_cursor;
     Bool use_fullscreen;
     Bool have_shm;
+    Bool have_shm_fd;
+    Bool have_shm_pixmaps;
+    Bool use_present;
+    Bool have_present;
+    Bool use_huge_pages;
+    uint8_t shm_first_event;
+    Bool async_present;
+    int max_frames_in_flight;
+    int n_shm_buffers;
+    int n_threads;
+    Bool use_scroll_detection;
+    Bool use_host_transform;
+    Bool have_render_transform;
+    double host_scale;
+    Bool use_backing_pixmap;
+    long merge_pixels;          /* pixels costing as much as a request */
+    CARD32 frame_interval;      /* in milliseconds, 0 for no frame cap */
+    Bool use_presenter_thread;
+    Bool use_tile_hash;
+    Bool use_xinput2;
+    Bool have_xinput2;
+    uint8_t xinput_opcode;
+    xcb_input_device_id_t scroll_device;
+    HostXScrollAxis scroll_axes[HOSTX_MAX_SCROLL_AXES];
+    int n_scroll_axes;
+    uint8_t xkb_first_event;    /* 0 when we get core MappingNotify */
+    uint8_t key_classes[256];   /* EPHYR_KEY_CLASS_* of every keycode */
+    xcb_gcontext_t copy_gc;
+    xcb_gcontext_t show_gc;
+    xcb_gcontext_t fill_gc;
+    uint8_t *put_scratch;
+    size_t put_scratch_size;
 
     int n_screens;
     ScrnInfoPtr *screens;
@@ -334,6 +393,107 @@ hostx_use_fullscreen(void) {
     HostX.use_fullscreen = TRUE;
 }
 
+void
+hostx_use_async_present(int max_frames_in_flight) {
+    if (max_frames_in_flight < 1) {
+        max_frames_in_flight = 1;
+    } else if (max_frames_in_flight > EPHYR_MAX_FRAMES_IN_FLIGHT) {
+        max_frames_in_flight = EPHYR_MAX_FRAMES_IN_FLIGHT;
+    }
+
+    HostX.async_present = TRUE;
+    HostX.max_frames_in_flight = max_frames_in_flight;
+}
+
+void
+hostx_use_scroll_detection(void) {
+    HostX.use_scroll_detection = TRUE;
+}
+
+void
+hostx_use_host_transform(double scale) {
+    HostX.use_host_transform = TRUE;
+    HostX.host_scale = scale > 0 ? scale : 1.0;
+}
+
+void
+hostx_use_max_fps(int max_fps) {
+    HostX.frame_interval = max_fps > 0 ? (1000 + max_fps - 1) / max_fps : 0;
+}
+
+void
+hostx_use_presenter_thread(void) {
+    HostX.use_presenter_thread = TRUE;
+}
+
+void
+hostx_use_xinput2(void) {
+    HostX.use_xinput2 = TRUE;
+}
+
+void
+hostx_use_tile_hash(void) {
+    HostX.use_tile_hash = TRUE;
+}
+
+void
+hostx_use_backing_pixmap(void) {
+    HostX.use_backing_pixmap = TRUE;
+}
+
+Bool
+hostx_want_host_transform(ScrnInfoPtr screen) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+
+    return scrpriv->xform_x_dir != 0;
+}
+
+void
+hostx_unscale_pointer(ScrnInfoPtr screen, int *x, int *y) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+
+    if (scrpriv->xform_x_dir && HostX.host_scale != 1.0) {
+        *x = *x / HostX.host_scale;
+        *y = *y / HostX.host_scale;
+    }
+}
+
+void
+hostx_unscale_pointer_fp(ScrnInfoPtr screen, double *x, double *y) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+
+    if (scrpriv->xform_x_dir && HostX.host_scale != 1.0) {
+        *x /= HostX.host_scale;
+        *y /= HostX.host_scale;
+    }
+}
+
+void
+hostx_use_present_threads(int n_threads) {
+    HostX.n_threads = n_threads;
+}
+
+void
+hostx_use_present(void) {
+    HostX.use_present = TRUE;
+}
+
+void
+hostx_use_huge_pages(void) {
+    HostX.use_huge_pages = TRUE;
+}
+
+void
+hostx_use_shm_buffers(int n_buffers) {
+    if (n_buffers < 1) {
+        n_buffers = 1;
+    } else if (n_buffers > EPHYR_MAX_SHM_BUFFERS) {
+        n_buffers = EPHYR_MAX_SHM_BUFFERS;
+    }
+
+    HostX.n_shm_buffers = n_buffers;
+}
+
 Bool
 hostx_want_fullscreen(void) {
     return HostX.use_fullscreen;
@@ -392,6 +552,355 @@ hostx_set_title(char *title) {
     ephyrTitle = title;
 }
 
+static double
+hostx_fp3232_to_double(xcb_input_fp3232_t value) {
+    return value.integral + value.frac / 4294967296.0;
+}
+
+/**
+ * Finds out which valuators of the first host master pointer scroll, and
+ * their current values.  The slave device behind the master decides, so
+ * this is done again whenever it changes.
+ */
+static void
+hostx_xi2_query_scroll(void) {
+    xcb_input_xi_query_device_cookie_t cookie =
+        xcb_input_xi_query_device(HostX.conn, XCB_INPUT_DEVICE_ALL_MASTER);
+    xcb_input_xi_query_device_reply_t *reply =
+        xcb_input_xi_query_device_reply(HostX.conn, cookie, NULL);
+    xcb_input_xi_device_info_iterator_t info;
+
+    HostX.n_scroll_axes = 0;
+
+    if (!reply) {
+        return;
+    }
+
+    for (info = xcb_input_xi_query_device_infos_iterator(reply); info.rem;
+         xcb_input_xi_device_info_next(&info)) {
+        xcb_input_device_class_iterator_t class;
+
+        if (info.data->type != XCB_INPUT_DEVICE_TYPE_MASTER_POINTER) {
+            continue;
+        }
+
+        HostX.scroll_device = info.data->deviceid;
+
+        for (class = xcb_input_xi_device_info_classes_iterator(info.data);
+             class.rem; xcb_input_device_class_next(&class)) {
+            xcb_input_scroll_class_t *scroll;
+            HostXScrollAxis *axis;
+
+            if (class.data->type != XCB_INPUT_DEVICE_CLASS_TYPE_SCROLL ||
+                HostX.n_scroll_axes == HOSTX_MAX_SCROLL_AXES) {
+                continue;
+            }
+
+            scroll = (xcb_input_scroll_class_t *) class.data;
+            axis = &HostX.scroll_axes[HostX.n_scroll_axes++];
+            axis->number = scroll->number;
+            axis->vertical =
+                scroll->scroll_type == XCB_INPUT_SCROLL_TYPE_VERTICAL;
+            axis->increment = hostx_fp3232_to_double(scroll->increment);
+            axis->have_last = FALSE;
+
+            if (axis->increment == 0) {
+                HostX.n_scroll_axes--;
+            }
+        }
+
+        /* The current values, for the first event to have a reference */
+        for (class = xcb_input_xi_device_info_classes_iterator(info.data);
+             class.rem; xcb_input_device_class_next(&class)) {
+            xcb_input_valuator_class_t *valuator;
+            int i;
+
+            if (class.data->type != XCB_INPUT_DEVICE_CLASS_TYPE_VALUATOR) {
+                continue;
+            }
+
+            valuator = (xcb_input_valuator_class_t *) class.data;
+
+            for (i = 0; i < HostX.n_scroll_axes; i++) {
+                if (HostX.scroll_axes[i].number == valuator->number) {
+                    HostX.scroll_axes[i].last =
+                        hostx_fp3232_to_double(valuator->value);
+                    HostX.scroll_axes[i].have_last = TRUE;
+                }
+            }
+        }
+
+        break;
+    }
+
+    free(reply);
+}
+
+/**
+ * Has the host send XI2 pointer events for window instead of the core
+ * ones, which only know integer positions and buttons for scrolling.
+ */
+static void
+hostx_xi2_select(xcb_window_t window) {
+    struct {
+        xcb_input_event_mask_t head;
+        uint32_t mask;
+    } mask;
+    uint32_t core = XCB_EVENT_MASK_KEY_PRESS
+        | XCB_EVENT_MASK_KEY_RELEASE
+        | XCB_EVENT_MASK_EXPOSURE
+        | XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+
+    mask.head.deviceid = XCB_INPUT_DEVICE_ALL_MASTER;
+    mask.head.mask_len = 1;
+    mask.mask = XCB_INPUT_XI_EVENT_MASK_MOTION
+        | XCB_INPUT_XI_EVENT_MASK_BUTTON_PRESS
+        | XCB_INPUT_XI_EVENT_MASK_BUTTON_RELEASE
+        | XCB_INPUT_XI_EVENT_MASK_ENTER
+        | XCB_INPUT_XI_EVENT_MASK_DEVICE_CHANGED;
+
+    xcb_change_window_attributes(HostX.conn, window, XCB_CW_EVENT_MASK, &core);
+    xcb_input_xi_select_events(HostX.conn, window, 1, &mask.head);
+}
+
+/**
+ * Returns the XInput opcode when pointer events come from XI2, that is
+ * as XCB_GE_GENERIC events for that extension, or -1.
+ */
+int
+hostx_get_xi2_opcode(void) {
+    return HostX.have_xinput2 ? HostX.xinput_opcode : -1;
+}
+
+/**
+ * Called for XI2 DeviceChanged events: another slave device may now be
+ * behind the master pointer, with other scroll valuators.
+ */
+void
+hostx_xi2_device_changed(void) {
+    hostx_xi2_query_scroll();
+}
+
+/**
+ * Called for XI2 Enter events.  The pointer may have scrolled in other
+ * host windows, which we did not hear about, so the first motion event
+ * from now on only gives the scroll valuators their reference.
+ */
+void
+hostx_xi2_enter(void) {
+    int i;
+
+    for (i = 0; i < HostX.n_scroll_axes; i++) {
+        HostX.scroll_axes[i].have_last = FALSE;
+    }
+}
+
+/**
+ * Turns the scroll valuators of the XI2 motion event ev into scroll
+ * amounts, in clicks.  Returns FALSE if ev did not scroll.
+ */
+Bool
+hostx_xi2_scroll(xcb_input_motion_event_t *ev, double *dx, double *dy) {
+    uint32_t *mask = xcb_input_button_press_valuator_mask(ev);
+    int n_mask = xcb_input_button_press_valuator_mask_length(ev);
+    xcb_input_fp3232_t *values = xcb_input_button_press_axisvalues(ev);
+    int bit, value = 0, i;
+    double current;
+
+    *dx = *dy = 0;
+
+    if (ev->deviceid != HostX.scroll_device || !HostX.n_scroll_axes) {
+        return FALSE;
+    }
+
+    for (bit = 0; bit < n_mask * 32; bit++) {
+        if (!(mask[bit / 32] & (1u << (bit % 32)))) {
+            continue;
+        }
+
+        current = hostx_fp3232_to_double(values[value++]);
+
+        for (i = 0; i < HostX.n_scroll_axes; i++) {
+            HostXScrollAxis *axis = &HostX.scroll_axes[i];
+
+            if (axis->number != bit) {
+                continue;
+            }
+
+            if (axis->have_last) {
+                double delta = (current - axis->last) / axis->increment;
+
+                if (axis->vertical) {
+                    *dy += delta;
+                } else {
+                    *dx += delta;
+                }
+            }
+
+            axis->last = current;
+            axis->have_last = TRUE;
+        }
+    }
+
+    return *dx != 0 || *dy != 0;
+}
+
+/**
+ * Rebuilds the class of every host keycode from the first keysym the
+ * host keymap gives it, so that the grab hotkey is checked with a table
+ * load per key event.  Called at startup and whenever the host keyboard
+ * mapping changes.
+ */
+static void
+hostx_update_key_classes(void) {
+    const xcb_setup_t *setup = xcb_get_setup(HostX.conn);
+    xcb_get_keyboard_mapping_cookie_t mapping_c =
+        xcb_get_keyboard_mapping(HostX.conn, setup->min_keycode,
+                                 setup->max_keycode - setup->min_keycode + 1);
+    xcb_get_keyboard_mapping_reply_t *mapping_r =
+        xcb_get_keyboard_mapping_reply(HostX.conn, mapping_c, NULL);
+    xcb_keysym_t *keysyms;
+    int keycode, n_keycodes;
+
+    memset(HostX.key_classes, 0, sizeof(HostX.key_classes));
+
+    if (!mapping_r || !mapping_r->keysyms_per_keycode) {
+        free(mapping_r);
+        return;
+    }
+
+    keysyms = xcb_get_keyboard_mapping_keysyms(mapping_r);
+    n_keycodes = xcb_get_keyboard_mapping_keysyms_length(mapping_r) /
+        mapping_r->keysyms_per_keycode;
+
+    for (keycode = 0; keycode < n_keycodes; keycode++) {
+        uint8_t *class = &HostX.key_classes[setup->min_keycode + keycode];
+
+        switch (keysyms[keycode * mapping_r->keysyms_per_keycode]) {
+        case XK_Shift_L:
+        case XK_Shift_R:
+            *class = EPHYR_KEY_CLASS_SHIFT;
+            break;
+        case XK_Control_L:
+        case XK_Control_R:
+            *class = EPHYR_KEY_CLASS_CONTROL;
+            break;
+        }
+    }
+
+    free(mapping_r);
+}
+
+/**
+ * Returns the EPHYR_KEY_CLASS_* flags of a host keycode.
+ */
+uint8_t
+hostx_get_key_class(uint8_t keycode) {
+    return HostX.key_classes[keycode];
+}
+
+/**
+ * Asks for XKB MapNotify events: once a client used XKB, the host no
+ * longer sends it core MappingNotify events.
+ */
+static void
+hostx_select_keymap_changes(void) {
+    xcb_xkb_use_extension_cookie_t use_c;
+    xcb_xkb_use_extension_reply_t *use_r;
+
+    if (!hostx_has_extension(&xcb_xkb_id)) {
+        return;
+    }
+
+    use_c = xcb_xkb_use_extension(HostX.conn,
+                                  XCB_XKB_MAJOR_VERSION,
+                                  XCB_XKB_MINOR_VERSION);
+    use_r = xcb_xkb_use_extension_reply(HostX.conn, use_c, NULL);
+
+    if (use_r && use_r->supported) {
+        HostX.xkb_first_event =
+            xcb_get_extension_data(HostX.conn, &xcb_xkb_id)->first_event;
+        xcb_xkb_select_events(HostX.conn, XCB_XKB_ID_USE_CORE_KBD,
+                              XCB_XKB_EVENT_TYPE_MAP_NOTIFY, 0,
+                              XCB_XKB_EVENT_TYPE_MAP_NOTIFY,
+                              XCB_XKB_MAP_PART_KEY_SYMS,
+                              XCB_XKB_MAP_PART_KEY_SYMS, NULL);
+    }
+
+    free(use_r);
+}
+
+/**
+ * Really really check we have SysV shm - better way ?
+ */
+static Bool
+hostx_probe_shm_sysv(void) {
+    xcb_generic_error_t *e;
+    xcb_void_cookie_t cookie;
+    xcb_shm_seg_t shmseg;
+    int shmid;
+    void *shmaddr;
+
+    shmid = shmget(IPC_PRIVATE, 1, IPC_CREAT|0777);
+    if (shmid < 0) {
+        return FALSE;
+    }
+
+    shmaddr = shmat(shmid, 0, 0);
+    shmseg = xcb_generate_id(HostX.conn);
+    cookie = xcb_shm_attach_checked(HostX.conn, shmseg, shmid, TRUE);
+    e = xcb_request_check(HostX.conn, cookie);
+
+    if (e) {
+        free(e);
+    } else {
+        xcb_shm_detach(HostX.conn, shmseg);
+    }
+
+    if (shmaddr != (void *) -1) {
+        shmdt(shmaddr);
+    }
+    shmctl(shmid, IPC_RMID, 0);
+    return e == NULL;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/**
+ * Checks that the host really takes segments as file descriptors by
+ * attaching a one page memfd.
+ */
+static Bool
+hostx_probe_shm_fd(void) {
+    xcb_generic_error_t *e;
+    xcb_void_cookie_t cookie;
+    xcb_shm_seg_t shmseg;
+    int fd;
+
+    fd = memfd_create("ephyr-probe", MFD_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    if (ftruncate(fd, getpagesize()) < 0) {
+        close(fd);
+        return FALSE;
+    }
+
+    /* xcb closes the descriptor once it has been sent */
+    shmseg = xcb_generate_id(HostX.conn);
+    cookie = xcb_shm_attach_fd_checked(HostX.conn, shmseg, fd, TRUE);
+    e = xcb_request_check(HostX.conn, cookie);
+
+    if (e) {
+        free(e);
+        return FALSE;
+    }
+
+    xcb_shm_detach(HostX.conn, shmseg);
+    return TRUE;
+}
+#endif
+
 #ifdef __SUNPRO_C
 /* prevent "Function has no return statement" error for x_io_error_handler */
 #pragma does_not_return(exit)
@@ -498,6 +1007,24 @@ hostx_init(void) {
 
     xcb_change_gc(HostX.conn, HostX.gc, XCB_GC_FOREGROUND, &pixel);
 
+    if (HostX.use_scroll_detection) {
+        /* Scrolling copies must tell us what they could not copy */
+        uint32_t exposures = TRUE;
+
+        HostX.copy_gc = xcb_generate_id(HostX.conn);
+        xcb_create_gc(HostX.conn, HostX.copy_gc, HostX.winroot,
+                      XCB_GC_GRAPHICS_EXPOSURES, &exposures);
+    }
+
+    if (HostX.use_backing_pixmap) {
+        /* Copies from the backing pixmap can not miss anything */
+        uint32_t exposures = FALSE;
+
+        HostX.show_gc = xcb_generate_id(HostX.conn);
+        xcb_create_gc(HostX.conn, HostX.show_gc, HostX.winroot,
+                      XCB_GC_GRAPHICS_EXPOSURES, &exposures);
+    }
+
     cursor_pxm = xcb_generate_id(HostX.conn);
     xcb_create_pixmap(HostX.conn, 1, cursor_pxm, HostX.winroot, 1, 1);
     cursor_gc = xcb_generate_id(HostX.conn);
@@ -524,34 +1051,121 @@ hostx_init(void) {
         fprintf(stderr, "\nXephyr unable to use SHM XImages\n");
         HostX.have_shm = FALSE;
     } else {
-        /* Really really check we have shm - better way ?*/
-        xcb_shm_segment_info_t shminfo;
-        xcb_generic_error_t *e;
-        xcb_void_cookie_t cookie;
-        xcb_shm_seg_t shmseg;
+        xcb_shm_query_version_cookie_t version_c =
+            xcb_shm_query_version(HostX.conn);
+        xcb_shm_query_version_reply_t *version_r =
+            xcb_shm_query_version_reply(HostX.conn, version_c, NULL);
+
+        HostX.have_shm_pixmaps = version_r && version_r->shared_pixmaps;
+
+#ifdef HAVE_MEMFD_CREATE
+        /* MIT-SHM 1.2 lets us pass the segments as file descriptors */
+        if (version_r &&
+            (version_r->major_version > 1 ||
+             (version_r->major_version == 1 &&
+              version_r->minor_version >= 2))) {
+            HostX.have_shm_fd = hostx_probe_shm_fd();
+        }
+#endif
+        free(version_r);
+
+        /* Hosts without SysV IPC in reach (containers, remote) may
+         * still take descriptors, so SysV is only tried as a fallback */
+        HostX.have_shm = HostX.have_shm_fd || hostx_probe_shm_sysv();
+
+        if (HostX.have_shm) {
+            HostX.shm_first_event =
+                xcb_get_extension_data(HostX.conn, &xcb_shm_id)->first_event;
+        } else {
+            fprintf(stderr, "\nXephyr unable to use SHM XImages\n");
+            HostX.have_shm_pixmaps = FALSE;
+        }
+    }
 
-        HostX.have_shm = TRUE;
+    /* Present flips SHM pixmaps, and takes its update areas as regions */
+    if (HostX.use_present) {
+        if (HostX.have_shm && HostX.have_shm_pixmaps &&
+            hostx_has_extension(&xcb_present_id) &&
+            hostx_has_extension(&xcb_xfixes_id)) {
+            xcb_present_query_version_cookie_t present_c =
+                xcb_present_query_version(HostX.conn,
+                                          XCB_PRESENT_MAJOR_VERSION,
+                                          XCB_PRESENT_MINOR_VERSION);
+            xcb_xfixes_query_version_cookie_t xfixes_c =
+                xcb_xfixes_query_version(HostX.conn,
+                                         XCB_XFIXES_MAJOR_VERSION,
+                                         XCB_XFIXES_MINOR_VERSION);
+
+            free(xcb_present_query_version_reply(HostX.conn, present_c, NULL));
+            free(xcb_xfixes_query_version_reply(HostX.conn, xfixes_c, NULL));
+            HostX.have_present = TRUE;
+        } else {
+            fprintf(stderr, "\nXephyr unable to use the Present extension\n");
+        }
+    }
 
-        shminfo.shmid = shmget(IPC_PRIVATE, 1, IPC_CREAT|0777);
-        shminfo.shmaddr = shmat(shminfo.shmid,0,0);
+    /* Picture transforms and the pad repeat mode need RENDER 0.10 */
+    if (HostX.use_host_transform) {
+        xcb_render_query_version_reply_t *render_r = NULL;
 
-        shmseg = xcb_generate_id(HostX.conn);
-        cookie = xcb_shm_attach_checked(HostX.conn, shmseg, shminfo.shmid,
-                                        TRUE);
-        e = xcb_request_check(HostX.conn, cookie);
+        if (hostx_has_extension(&xcb_render_id)) {
+            xcb_render_query_version_cookie_t render_c =
+                xcb_render_query_version(HostX.conn,
+                                         XCB_RENDER_MAJOR_VERSION,
+                                         XCB_RENDER_MINOR_VERSION);
 
-        if (e) {
-            fprintf(stderr, "\nXephyr unable to use SHM XImages\n");
-            HostX.have_shm = FALSE;
-            free(e);
+            render_r = xcb_render_query_version_reply(HostX.conn, render_c,
+                                                      NULL);
         }
 
-        shmdt(shminfo.shmaddr);
-        shmctl(shminfo.shmid, IPC_RMID, 0);
+        HostX.have_render_transform = render_r &&
+            (render_r->major_version > 0 || render_r->minor_version >= 10);
+        free(render_r);
+
+        if (!HostX.have_render_transform) {
+            fprintf(stderr, "\nXephyr unable to transform with RENDER, "
+                    "rotating on the CPU\n");
+        }
+    }
+
+    hostx_select_keymap_changes();
+    hostx_update_key_classes();
+
+    /* Smooth scrolling came with XInput 2.1 */
+    if (HostX.use_xinput2) {
+        xcb_input_xi_query_version_reply_t *xi_r = NULL;
+
+        if (hostx_has_extension(&xcb_input_id)) {
+            xcb_input_xi_query_version_cookie_t xi_c =
+                xcb_input_xi_query_version(HostX.conn, 2, 1);
+
+            xi_r = xcb_input_xi_query_version_reply(HostX.conn, xi_c, NULL);
+        }
+
+        HostX.have_xinput2 = xi_r &&
+            (xi_r->major_version > 2 ||
+             (xi_r->major_version == 2 && xi_r->minor_version >= 1));
+        free(xi_r);
+
+        if (HostX.have_xinput2) {
+            HostX.xinput_opcode =
+                xcb_get_extension_data(HostX.conn, &xcb_input_id)->major_opcode;
+            hostx_xi2_query_scroll();
+        } else {
+            fprintf(stderr, "\nXephyr unable to use XInput 2.1, "
+                    "using core pointer events\n");
+        }
     }
 
     xcb_flush(HostX.conn);
 
+    /* The workers call the converters, they must be ready first */
+    ephyr_convert_init();
+
+    if (HostX.n_threads > 0 && !ephyr_workers_init(HostX.n_threads)) {
+        fprintf(stderr, "\nXephyr unable to start presentation threads\n");
+    }
+
     /* Setup the pause time between paints when debugging updates */
     HostX.damage_debug_msec = 20000;    /* 1/50 th of a second */
 
@@ -569,7 +1183,8 @@ hostx_init_window(ScrnInfoPtr pScrn) {
 
     scrpriv->win = xcb_generate_id(HostX.conn);
     scrpriv->server_depth = HostX.depth;
-    scrpriv->ximg = NULL;
+    scrpriv->buffers[0].ximg = NULL;
+    scrpriv->n_buffers = 0;
     scrpriv->win_x = 0;
     scrpriv->win_y = 0;
 
@@ -669,8 +1284,17 @@ hostx_init_window(ScrnInfoPtr pScrn) {
                                      &HostX.empty_cursor);
     }
 
-    return TRUE
-}
+    if (HostX.have_xinput2) {
+        hostx_xi2_select(scrpriv->win);
+    }
+
+    ephyr_window_register(scrpriv->win, scrpriv);
+    if (scrpriv->win_pre_existing != XCB_WINDOW_NONE) {
+        ephyr_window_register(scrpriv->win_pre_existing, scrpriv);
+    }
+
+    return TRUE;
+}
 
 int
 hostx_get_depth(void) {
@@ -722,333 +1346,2783 @@ hostx_get_visual_masks(ScrnInfoPtr screen,
         *gmsk = 0x0;
         *bmsk = 0x0;
     }
-}
+}
+
+static int
+hostx_calculate_color_shift(unsigned long mask) {
+    int shift = 1;
+
+    /* count # of bits in mask */
+    while ((mask = (mask >> 1))) {
+        shift++;
+    }
+
+    /* cmap entry is an unsigned char so adjust it by size of that */
+    shift = shift - sizeof(unsigned char) * 8;
+
+    if (shift < 0) {
+        shift = 0;
+    }
+
+    return shift;
+}
+
+void
+hostx_set_cmap_entry(ScreenPtr pScreen, unsigned char idx,
+                     unsigned char r, unsigned char g, unsigned char b) {
+    KdScreenPriv(pScreen);
+    ScrnInfoPtr screen = pScreenPriv->screen;
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+/* need to calculate the shifts for RGB because server could be BGR. */
+/* XXX Not sure if this is correct for 8 on 16, but this works for 8 on 24.*/
+    static int rshift, bshift, gshift = 0;
+    static int first_time = 1;
+
+    if (first_time) {
+        first_time = 0;
+        rshift = hostx_calculate_color_shift(HostX.visual->red_mask);
+        gshift = hostx_calculate_color_shift(HostX.visual->green_mask);
+        bshift = hostx_calculate_color_shift(HostX.visual->blue_mask);
+    }
+
+    scrpriv->cmap[idx] = ((r << rshift) & HostX.visual->red_mask)   |
+                         ((g << gshift) & HostX.visual->green_mask) |
+                         ((b << bshift) & HostX.visual->blue_mask);
+}
+
+/* Sequence numbers are 32 bits wide and may wrap around */
+#define hostx_seq_before_eq(a, b) ((int32_t) ((a) - (b)) <= 0)
+
+/**
+ * Marks every SHM frame of the screen up to (and including) the put
+ * request with sequence number seq as consumed by the host, which also
+ * releases the SHM buffers those frames were read from.
+ */
+static void
+hostx_complete_frames(EphyrScrPriv *scrpriv, unsigned int seq) {
+    int i, done = 0;
+
+    while (done < scrpriv->frames_in_flight &&
+           hostx_seq_before_eq(scrpriv->frame_seq[done], seq)) {
+        done++;
+    }
+
+    if (done) {
+        scrpriv->frames_in_flight -= done;
+        memmove(scrpriv->frame_seq, scrpriv->frame_seq + done,
+                scrpriv->frames_in_flight * sizeof(scrpriv->frame_seq[0]));
+    }
+
+    for (i = 0; i < scrpriv->n_buffers; i++) {
+        EphyrHostBuffer *buffer = &scrpriv->buffers[i];
+
+        if (buffer->busy && hostx_seq_before_eq(buffer->busy_seq, seq)) {
+            buffer->busy = FALSE;
+        }
+    }
+}
+
+/**
+ * Blocks until the host has caught up with every frame sent so far.
+ * Used to throttle presentation when too many frames are in flight and
+ * before a busy SHM segment is reused or freed; ShmCompletion events
+ * still queued for those frames are ignored by hostx_complete_frames()
+ * afterwards.
+ */
+static void
+hostx_wait_frames(EphyrScrPriv *scrpriv) {
+    int i;
+
+    EPHYR_DBG("host is %d frames behind on screen %d, throttling",
+              scrpriv->frames_in_flight, scrpriv->mynum);
+    xcb_aux_sync(HostX.conn);
+    scrpriv->frames_in_flight = 0;
+
+    for (i = 0; i < scrpriv->n_buffers; i++) {
+        scrpriv->buffers[i].busy = FALSE;
+    }
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* Default huge page size on the platforms we care about */
+#define HOSTX_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * Backs the buffer XImage with a sealed memfd and hands the descriptor
+ * to the host with xcb_shm_attach_fd().  Unlike SysV segments, this is
+ * not bound by kernel.shmmax/shmall and the memory goes away with the
+ * last mapping, even if we crash.
+ */
+static Bool
+hostx_alloc_memfd_buffer(EphyrHostBuffer *buffer, size_t size) {
+    unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    xcb_generic_error_t *e;
+    xcb_void_cookie_t cookie;
+    void *addr;
+    int fd = -1;
+
+#ifdef MFD_HUGETLB
+    if (HostX.use_huge_pages) {
+        size_t huge_size = (size + HOSTX_HUGE_PAGE_SIZE - 1) &
+                           ~((size_t) HOSTX_HUGE_PAGE_SIZE - 1);
+
+        fd = memfd_create("ephyr-fb", flags | MFD_HUGETLB);
+
+        if (fd >= 0 && ftruncate(fd, huge_size) < 0) {
+            close(fd);
+            fd = -1;
+        }
+
+        if (fd >= 0) {
+            size = huge_size;
+        } else {
+            EPHYR_DBG("No huge pages for the framebuffer, using normal ones");
+        }
+    }
+#endif
+
+    if (fd < 0) {
+        fd = memfd_create("ephyr-fb", flags);
+
+        if (fd < 0) {
+            return FALSE;
+        }
+
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            return FALSE;
+        }
+    }
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return FALSE;
+    }
+
+#ifdef F_ADD_SEALS
+    /* Neither side may resize the segment from now on */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+    /* xcb closes the descriptor once it has been sent */
+    buffer->shminfo.shmseg = xcb_generate_id(HostX.conn);
+    cookie = xcb_shm_attach_fd_checked(HostX.conn,
+                                       buffer->shminfo.shmseg,
+                                       fd,
+                                       FALSE);
+    e = xcb_request_check(HostX.conn, cookie);
+
+    if (e) {
+        free(e);
+        munmap(addr, size);
+        return FALSE;
+    }
+
+    buffer->ximg->data = addr;
+    buffer->shminfo.shmaddr = addr;
+    buffer->shminfo.shmid = -1;
+    buffer->shm_size = size;
+    EPHYR_DBG("memfd segment attached %p", buffer->shminfo.shmaddr);
+    return TRUE;
+}
+#endif
+
+/**
+ * Creates an XImage backed by a new MIT-SHM segment and attaches the
+ * segment to the host server.  A memfd is used when the host supports
+ * MIT-SHM 1.2, a SysV segment otherwise.
+ */
+static Bool
+hostx_alloc_shm_buffer(EphyrHostBuffer *buffer, int width, int height) {
+    buffer->ximg = xcb_image_create_native(HostX.conn,
+                                           width,
+                                           height,
+                                           XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                           HostX.depth,
+                                           NULL,
+                                           ~0,
+                                           NULL);
+    buffer->pixmap = XCB_NONE;
+    buffer->busy = FALSE;
+    RegionNull(&buffer->stale);
+
+#ifdef HAVE_MEMFD_CREATE
+    if (HostX.have_shm_fd &&
+        hostx_alloc_memfd_buffer(buffer, buffer->ximg->stride * height)) {
+        return TRUE;
+    }
+#endif
+
+    buffer->shm_size = 0;
+    buffer->shminfo.shmid =
+        shmget(IPC_PRIVATE,
+               buffer->ximg->stride * height,
+               IPC_CREAT | 0777);
+    buffer->ximg->data = shmat(buffer->shminfo.shmid, 0, 0);
+
+    if (buffer->ximg->data == (uint8_t *)-1) {
+        buffer->ximg->data = NULL;
+        xcb_image_destroy(buffer->ximg);
+        buffer->ximg = NULL;
+        RegionUninit(&buffer->stale);
+        shmctl(buffer->shminfo.shmid, IPC_RMID, 0);
+        return FALSE;
+    }
+
+    buffer->shminfo.shmaddr = buffer->ximg->data;
+    EPHYR_DBG("SHM segment attached %p", buffer->shminfo.shmaddr);
+    buffer->shminfo.shmseg = xcb_generate_id(HostX.conn);
+    xcb_shm_attach(HostX.conn,
+                   buffer->shminfo.shmseg,
+                   buffer->shminfo.shmid,
+                   FALSE);
+    return TRUE;
+}
+
+static void
+hostx_free_buffer(EphyrHostBuffer *buffer) {
+    if (!buffer->ximg) {
+        return;
+    }
+
+    if (buffer->pixmap != XCB_NONE) {
+        xcb_free_pixmap(HostX.conn, buffer->pixmap);
+        buffer->pixmap = XCB_NONE;
+    }
+
+    if (buffer->shminfo.shmaddr && buffer->shm_size) {
+        xcb_shm_detach(HostX.conn, buffer->shminfo.shmseg);
+        munmap(buffer->shminfo.shmaddr, buffer->shm_size);
+        buffer->shminfo.shmaddr = NULL;
+        buffer->shm_size = 0;
+    } else if (buffer->shminfo.shmaddr) {
+        xcb_shm_detach(HostX.conn, buffer->shminfo.shmseg);
+        shmdt(buffer->shminfo.shmaddr);
+        shmctl(buffer->shminfo.shmid, IPC_RMID, 0);
+        buffer->shminfo.shmaddr = NULL;
+    } else {
+        free(buffer->ximg->data);
+    }
+
+    buffer->ximg->data = NULL;
+    xcb_image_destroy(buffer->ximg);
+    buffer->ximg = NULL;
+    buffer->busy = FALSE;
+    RegionUninit(&buffer->stale);
+}
+
+/**
+ * Wraps each SHM buffer of the screen in a host pixmap for Present, and
+ * asks for the Present events of the host window.  Those go to a queue
+ * of their own, drained by the presentation code only.
+ */
+static void
+hostx_present_init_screen(EphyrScrPriv *scrpriv, int width, int height) {
+    int i;
+
+    for (i = 0; i < scrpriv->n_buffers; i++) {
+        EphyrHostBuffer *buffer = &scrpriv->buffers[i];
+
+        buffer->pixmap = xcb_generate_id(HostX.conn);
+        xcb_shm_create_pixmap(HostX.conn, buffer->pixmap, scrpriv->win,
+                              width, height, HostX.depth,
+                              buffer->shminfo.shmseg,
+                              buffer->ximg->data - buffer->shminfo.shmaddr);
+    }
+
+    if (!scrpriv->present_events) {
+        scrpriv->present_eid = xcb_generate_id(HostX.conn);
+        xcb_present_select_input(HostX.conn, scrpriv->present_eid,
+                                 scrpriv->win,
+                                 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY |
+                                 XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+        scrpriv->present_events =
+            xcb_register_for_special_xge(HostX.conn, &xcb_present_id,
+                                         scrpriv->present_eid, NULL);
+
+        scrpriv->present_update = xcb_generate_id(HostX.conn);
+        xcb_xfixes_create_region(HostX.conn, scrpriv->present_update,
+                                 0, NULL);
+    }
+
+    scrpriv->present_msc = 0;
+    scrpriv->frames_in_flight = 0;
+}
+
+/**
+ * CompleteNotify tells us a frame reached the screen, and at which MSC,
+ * IdleNotify that the host is done with the pixmap of a frame.
+ */
+static void
+hostx_present_handle_event(EphyrScrPriv *scrpriv,
+                           xcb_present_generic_event_t *ev) {
+    int i;
+
+    switch (ev->evtype) {
+    case XCB_PRESENT_COMPLETE_NOTIFY: {
+        xcb_present_complete_notify_event_t *complete =
+            (xcb_present_complete_notify_event_t *) ev;
+
+        if (complete->kind == XCB_PRESENT_COMPLETE_KIND_PIXMAP) {
+            scrpriv->present_msc = complete->msc;
+
+            if (scrpriv->frames_in_flight > 0) {
+                scrpriv->frames_in_flight--;
+            }
+        }
+        break;
+    }
+    case XCB_PRESENT_IDLE_NOTIFY: {
+        xcb_present_idle_notify_event_t *idle =
+            (xcb_present_idle_notify_event_t *) ev;
+
+        for (i = 0; i < scrpriv->n_buffers; i++) {
+            if (scrpriv->buffers[i].pixmap == idle->pixmap) {
+                scrpriv->buffers[i].busy = FALSE;
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    free(ev);
+}
+
+static void
+hostx_present_drain_events(EphyrScrPriv *scrpriv) {
+    xcb_generic_event_t *ev;
+
+    while ((ev = xcb_poll_for_special_event(HostX.conn,
+                                            scrpriv->present_events))) {
+        hostx_present_handle_event(scrpriv,
+                                   (xcb_present_generic_event_t *) ev);
+    }
+}
+
+/**
+ * Waits for the presenter thread to hand buffer back.  Only used when
+ * the buffer is about to be freed or written outside of the ring.
+ */
+static void
+hostx_wait_presented(EphyrHostBuffer *buffer) {
+    while (__atomic_load_n(&buffer->presenting, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+/**
+ * Releases what hostx_init() set up for the whole server.  Only called
+ * once the server terminates, after every screen was closed.
+ */
+void
+hostx_fini(void) {
+    ephyr_workers_fini();
+}
+
+/**
+ * Releases what a screen keeps across server generations.  Runs after
+ * the last hostx_close_screen(), so the presenter no longer owns any
+ * buffer.
+ */
+void
+hostx_free_screen(ScrnInfoPtr screen) {
+    EphyrScrPrivPtr scrpriv = screen->driverPrivate;
+
+    ephyr_presenter_destroy(scrpriv->presenter);
+    scrpriv->presenter = NULL;
+    scrpriv->threaded = FALSE;
+
+    /* The private goes away, events must not find it anymore */
+    ephyr_window_unregister(scrpriv->win);
+    if (scrpriv->win_pre_existing != XCB_WINDOW_NONE) {
+        ephyr_window_unregister(scrpriv->win_pre_existing);
+    }
+}
+
+void
+hostx_close_screen(ScrnInfoPtr screen) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    int i;
+
+    /* The host may still be reading from the segments */
+    if (HostX.have_shm) {
+        hostx_wait_frames(scrpriv);
+
+        for (i = 0; i < scrpriv->n_buffers; i++) {
+            hostx_wait_presented(&scrpriv->buffers[i]);
+        }
+    }
+
+    /* The next init decides again whether Present is used */
+    if (scrpriv->present_events) {
+        hostx_present_drain_events(scrpriv);
+        scrpriv->frames_in_flight = 0;
+
+        xcb_present_select_input(HostX.conn, scrpriv->present_eid,
+                                 scrpriv->win, 0);
+        xcb_unregister_for_special_event(HostX.conn,
+                                         scrpriv->present_events);
+        xcb_xfixes_destroy_region(HostX.conn, scrpriv->present_update);
+        scrpriv->present_events = NULL;
+        scrpriv->present_update = XCB_NONE;
+    }
+
+    for (i = 0; i < scrpriv->n_buffers; i++) {
+        hostx_free_buffer(&scrpriv->buffers[i]);
+    }
+
+    scrpriv->n_buffers = 0;
+    scrpriv->back_buffer = 0;
+
+    if (scrpriv->scroll_prev) {
+        free(scrpriv->scroll_prev);
+        free(scrpriv->scroll_hashes);
+        scrpriv->scroll_prev = NULL;
+        scrpriv->scroll_hashes = NULL;
+        RegionUninit(&scrpriv->scroll_known);
+    }
+
+    free(scrpriv->tile_hashes);
+    scrpriv->tile_hashes = NULL;
+
+    hostx_transform_fini(scrpriv);
+
+    RegionUninit(&scrpriv->pending_region);
+    RegionNull(&scrpriv->pending_region);
+
+    TimerFree(scrpriv->frame_timer);
+    scrpriv->frame_timer = NULL;
+    scrpriv->frame_pending = FALSE;
+    scrpriv->presenter_retry = FALSE;
+
+    if (scrpriv->backing_pixmap) {
+        xcb_free_pixmap(HostX.conn, scrpriv->backing_pixmap);
+        scrpriv->backing_pixmap = XCB_NONE;
+    }
+
+    free(scrpriv->fb_data);
+    scrpriv->fb_data = NULL;
+}
+
+/**
+ * Sets up scroll detection for the framebuffer fb: we keep a copy of it
+ * as the host window last showed it, and which parts of that copy are
+ * actually on the window.
+ */
+static void
+hostx_scroll_init(EphyrScrPriv *scrpriv, unsigned char *fb,
+                  int width, int height, int stride, int bpp) {
+    scrpriv->scroll_max_lines = width > height ? width : height;
+    scrpriv->scroll_prev = xallocarray(stride, height);
+    scrpriv->scroll_hashes = xallocarray(2 * scrpriv->scroll_max_lines,
+                                         sizeof(uint64_t));
+
+    if (!scrpriv->scroll_prev || !scrpriv->scroll_hashes) {
+        free(scrpriv->scroll_prev);
+        free(scrpriv->scroll_hashes);
+        scrpriv->scroll_prev = NULL;
+        scrpriv->scroll_hashes = NULL;
+        return;
+    }
+
+    scrpriv->scroll_fb = fb;
+    scrpriv->scroll_stride = stride;
+    scrpriv->scroll_cpp = bpp >> 3;
+    RegionNull(&scrpriv->scroll_known);
+}
+
+/* Side of the square tiles whose content is hashed */
+#define HOSTX_TILE_SIZE 64
+
+/**
+ * Sets up tile hashing for the framebuffer fb.  All hashes start unknown,
+ * so the first damage to every tile is painted.
+ */
+static void
+hostx_tile_init(EphyrScrPriv *scrpriv, unsigned char *fb,
+                int stride, int bpp) {
+    scrpriv->tile_cols = (scrpriv->fb_width + HOSTX_TILE_SIZE - 1) /
+        HOSTX_TILE_SIZE;
+    scrpriv->tile_rows = (scrpriv->fb_height + HOSTX_TILE_SIZE - 1) /
+        HOSTX_TILE_SIZE;
+    scrpriv->tile_hashes = calloc(scrpriv->tile_cols * scrpriv->tile_rows,
+                                  sizeof(uint64_t));
+    scrpriv->tile_fb = fb;
+    scrpriv->tile_stride = stride;
+    scrpriv->tile_cpp = bpp >> 3;
+}
+
+static xcb_render_fixed_t
+hostx_double_to_fixed(double value) {
+    return (xcb_render_fixed_t) floor(value * 65536.0 + 0.5);
+}
+
+/**
+ * Sets up the host side of RENDER transforms: the fb is put into a
+ * backing pixmap of its own size, composited into the window through a
+ * picture transform that maps window pixels back to fb ones.  That
+ * undoes the scale, then walks each host axis in its fb direction.
+ */
+static Bool
+hostx_transform_init(EphyrScrPriv *scrpriv, int fb_width, int fb_height) {
+    xcb_render_query_pict_formats_cookie_t formats_c;
+    xcb_render_query_pict_formats_reply_t *formats;
+    xcb_render_pictvisual_t *pictvisual;
+    xcb_render_transform_t transform;
+    double m[2][3] = { { 0 } };
+    uint32_t repeat = XCB_RENDER_REPEAT_PAD;
+    int i;
+
+    formats_c = xcb_render_query_pict_formats(HostX.conn);
+    formats = xcb_render_query_pict_formats_reply(HostX.conn, formats_c,
+                                                  NULL);
+    if (!formats) {
+        return FALSE;
+    }
+
+    pictvisual = xcb_render_util_find_visual_format(formats,
+                                                    HostX.visual->visual_id);
+    if (!pictvisual) {
+        free(formats);
+        return FALSE;
+    }
+
+    scrpriv->backing_pixmap = xcb_generate_id(HostX.conn);
+    xcb_create_pixmap(HostX.conn, HostX.depth, scrpriv->backing_pixmap,
+                      scrpriv->win, fb_width, fb_height);
+
+    scrpriv->xform_src = xcb_generate_id(HostX.conn);
+    xcb_render_create_picture(HostX.conn, scrpriv->xform_src,
+                              scrpriv->backing_pixmap, pictvisual->format,
+                              XCB_RENDER_CP_REPEAT, &repeat);
+
+    scrpriv->xform_dst = xcb_generate_id(HostX.conn);
+    xcb_render_create_picture(HostX.conn, scrpriv->xform_dst,
+                              scrpriv->win, pictvisual->format, 0, NULL);
+    free(formats);
+
+    for (i = 0; i < 2; i++) {
+        int dir = i ? scrpriv->xform_y_dir : scrpriv->xform_x_dir;
+        int axis = abs(dir) - 1;
+
+        m[axis][i] = (dir > 0 ? 1.0 : -1.0) / HostX.host_scale;
+        m[axis][2] = dir > 0 ? 0 : (axis ? fb_height : fb_width);
+    }
+
+    transform.matrix11 = hostx_double_to_fixed(m[0][0]);
+    transform.matrix12 = hostx_double_to_fixed(m[0][1]);
+    transform.matrix13 = hostx_double_to_fixed(m[0][2]);
+    transform.matrix21 = hostx_double_to_fixed(m[1][0]);
+    transform.matrix22 = hostx_double_to_fixed(m[1][1]);
+    transform.matrix23 = hostx_double_to_fixed(m[1][2]);
+    transform.matrix31 = 0;
+    transform.matrix32 = 0;
+    transform.matrix33 = hostx_double_to_fixed(1.0);
+    xcb_render_set_picture_transform(HostX.conn, scrpriv->xform_src,
+                                     transform);
+
+    if (HostX.host_scale != 1.0) {
+        xcb_render_set_picture_filter(HostX.conn, scrpriv->xform_src,
+                                      strlen("bilinear"), "bilinear",
+                                      0, NULL);
+    }
+
+    return TRUE;
+}
+
+static void
+hostx_transform_fini(EphyrScrPriv *scrpriv) {
+    if (!scrpriv->xform_x_dir) {
+        return;
+    }
+
+    xcb_render_free_picture(HostX.conn, scrpriv->xform_src);
+    xcb_render_free_picture(HostX.conn, scrpriv->xform_dst);
+    scrpriv->xform_x_dir = scrpriv->xform_y_dir = 0;
+}
+
+/**
+ * Composites the boxes of region, in fb coordinates, from the backing
+ * pixmap into the window.  Nothing is flushed here.
+ */
+static void
+hostx_transform_region(EphyrScrPriv *scrpriv, RegionPtr region) {
+    int nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    double scale = HostX.host_scale;
+    /* Bilinear filtering blends in the neighbours of each fb pixel */
+    int margin = scale != 1.0;
+
+    if (!scrpriv->xform_x_dir) {
+        return;
+    }
+
+    for (; nbox--; pbox++) {
+        BoxRec box;
+        int x1, y1, x2, y2;
+
+        ephyr_rotate_box(scrpriv->xform_x_dir, scrpriv->xform_y_dir,
+                         scrpriv->fb_width, scrpriv->fb_height, pbox, &box);
+
+        x1 = max((int) floor(box.x1 * scale) - margin, 0);
+        y1 = max((int) floor(box.y1 * scale) - margin, 0);
+        x2 = min((int) ceil(box.x2 * scale) + margin, scrpriv->win_width);
+        y2 = min((int) ceil(box.y2 * scale) + margin, scrpriv->win_height);
+
+        if (x1 < x2 && y1 < y2) {
+            xcb_render_composite(HostX.conn, XCB_RENDER_PICT_OP_SRC,
+                                 scrpriv->xform_src, XCB_NONE,
+                                 scrpriv->xform_dst,
+                                 x1, y1, 0, 0, x1, y1, x2 - x1, y2 - y1);
+        }
+    }
+}
+
+static int hostx_simplify_boxes(RegionPtr region, BoxPtr *boxes);
+static void hostx_calibrate_merge(EphyrScrPriv *scrpriv);
+
+/* The drawable images are put into: the window, or the backing pixmap
+ * that is then shown in it */
+static xcb_drawable_t
+hostx_put_drawable(EphyrScrPriv *scrpriv) {
+    return scrpriv->backing_pixmap ? scrpriv->backing_pixmap : scrpriv->win;
+}
+
+/**
+ * Shows the boxes of region, which were put into the backing pixmap, in
+ * the window.  Does nothing when images go to the window directly.
+ */
+static void
+hostx_show_region(EphyrScrPriv *scrpriv, RegionPtr region) {
+    BoxPtr boxes, pbox;
+    int nbox;
+
+    if (scrpriv->xform_x_dir) {
+        hostx_transform_region(scrpriv, region);
+        return;
+    }
+
+    if (!scrpriv->backing_pixmap) {
+        return;
+    }
+
+    /* The backing pixmap is a whole copy of the fb */
+    nbox = hostx_simplify_boxes(region, &boxes);
+
+    for (pbox = boxes; nbox--; pbox++) {
+        xcb_copy_area(HostX.conn, scrpriv->backing_pixmap, scrpriv->win,
+                      HostX.show_gc, pbox->x1, pbox->y1, pbox->x1, pbox->y1,
+                      pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+    }
+
+    if (boxes != RegionRects(region)) {
+        free(boxes);
+    }
+}
+
+/**
+ * Repaints the rectangle of the window given in window coordinates from
+ * the backing pixmap, typically for an Expose event.  Returns FALSE if
+ * there is no backing pixmap, or nothing was put into it yet, so the fb
+ * has to be uploaded again.  Nothing is flushed here.
+ */
+Bool
+hostx_expose_rect(ScrnInfoPtr screen, int x, int y, int width, int height) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+
+    if (!scrpriv->backing_pixmap || !scrpriv->backing_valid) {
+        return FALSE;
+    }
+
+    if (scrpriv->xform_x_dir) {
+        xcb_render_composite(HostX.conn, XCB_RENDER_PICT_OP_SRC,
+                             scrpriv->xform_src, XCB_NONE, scrpriv->xform_dst,
+                             x, y, 0, 0, x, y, width, height);
+    } else {
+        xcb_copy_area(HostX.conn, scrpriv->backing_pixmap, scrpriv->win,
+                      HostX.show_gc, x, y, x, y, width, height);
+    }
+
+    return TRUE;
+}
+
+/**
+ * hostx_screen_init creates the XImage that will contain the front buffer of
+ * the ephyr screen, and possibly offscreen memory.
+ *
+ * @param width width of the screen
+ * @param height height of the screen
+ * @param buffer_height  height of the rectangle to be allocated.
+ *
+ * hostx_screen_init() creates an XImage, using MIT-SHM if it's available.
+ * buffer_height can be used to create a larger offscreen buffer, which is used
+ * by fakexa for storing offscreen pixmap data.
+ *
+ * When more than one SHM buffer was requested, the framebuffer lives in
+ * private memory and each frame is copied into the next free SHM buffer
+ * before being handed to the host, so rendering never races with the host
+ * reading a segment.
+ */
+void *
+hostx_screen_init(ScrnInfoPtr screen,
+                  int x, int y,
+                  int width, int height, int buffer_height,
+                  int *bytes_per_line, int *bits_per_pixel) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    Bool shm_success = FALSE;
+    xcb_image_t *ximg;
+    int fb_width = width, fb_height = height;
+
+    if (!scrpriv) {
+        fprintf(stderr, "%s: Error in accessing hostx data\n", __func__);
+        exit(1);
+    }
+
+    EPHYR_DBG("host_screen=%p x=%d, y=%d, wxh=%dx%d, buffer_height=%d",
+              screen, x, y, width, height, buffer_height);
+
+    if (scrpriv->buffers[0].ximg != NULL) {
+        /* Free up the image data if previously used
+         * i.ie called by server reset
+         */
+        hostx_close_screen(screen);
+    }
+
+    /* The host rotates and scales the unrotated fb for us */
+    if (!ephyr_glamor && HostX.have_render_transform &&
+        ((scrpriv->randr & (RR_Rotate_90 | RR_Rotate_180 | RR_Rotate_270 |
+                            RR_Reflect_X | RR_Reflect_Y)) || HostX.host_scale != 1.0)) {
+        ephyr_rotation_dirs(scrpriv->randr,
+                            &scrpriv->xform_x_dir, &scrpriv->xform_y_dir);
+
+        if (abs(scrpriv->xform_x_dir) == abs(EPHYR_TOP_TO_BOTTOM)) {
+            fb_width = height;
+            fb_height = width;
+        }
+
+        if (hostx_transform_init(scrpriv, fb_width, fb_height)) {
+            width = ceil(width * HostX.host_scale);
+            height = ceil(height * HostX.host_scale);
+            buffer_height = max(buffer_height, fb_height);
+        } else {
+            scrpriv->xform_x_dir = scrpriv->xform_y_dir = 0;
+            fb_width = width;
+            fb_height = height;
+        }
+    }
+
+    scrpriv->fb_width = fb_width;
+    scrpriv->fb_height = fb_height;
+    RegionNull(&scrpriv->pending_region);
+
+    if (!ephyr_glamor && HostX.have_shm) {
+        int i, n_buffers = HostX.n_shm_buffers > 1 ? HostX.n_shm_buffers : 1;
+
+        /* Present needs somewhere to draw while the host shows a pixmap */
+        if (HostX.have_present && !scrpriv->xform_x_dir && n_buffers < 2) {
+            n_buffers = EPHYR_MAX_SHM_BUFFERS;
+        }
+
+        /* As does the presenter thread, which owns a buffer until the
+         * host read it */
+        if (HostX.use_presenter_thread && !scrpriv->xform_x_dir &&
+            n_buffers < 2) {
+            n_buffers = EPHYR_MAX_SHM_BUFFERS;
+        }
+
+        for (i = 0; i < n_buffers; i++) {
+            if (!hostx_alloc_shm_buffer(&scrpriv->buffers[i],
+                                        fb_width, buffer_height)) {
+                break;
+            }
+        }
+
+        if (i == n_buffers) {
+            scrpriv->n_buffers = n_buffers;
+            shm_success = TRUE;
+
+            /* Present flips whole pixmaps onto the window, with nothing
+             * to transform them on the way */
+            if (HostX.have_present && !scrpriv->xform_x_dir) {
+                hostx_present_init_screen(scrpriv, width, height);
+            }
+        } else {
+            EPHYR_DBG
+                ("Can't attach SHM Segment, falling back to plain XImages");
+            HostX.have_shm = FALSE;
+            HostX.have_present = FALSE;
+
+            while (i--) {
+                hostx_free_buffer(&scrpriv->buffers[i]);
+            }
+        }
+    }
+
+    if (!ephyr_glamor && !shm_success) {
+        EPHYR_DBG("Creating image %dx%d for screen scrpriv=%p\n",
+                  fb_width, buffer_height, scrpriv);
+        ximg = xcb_image_create_native(HostX.conn,
+                                       fb_width,
+                                       buffer_height,
+                                       XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                       HostX.depth,
+                                       NULL,
+                                       ~0,
+                                       NULL);
+
+        /* Match server byte order so that the image can be converted to
+         * the native byte order by xcb_image_put() before drawing */
+        if (host_depth_matches_server(scrpriv)) {
+            ximg->byte_order = IMAGE_BYTE_ORDER;
+        }
+
+        ximg->data = xallocarray(ximg->stride, buffer_height);
+
+        scrpriv->buffers[0].ximg = ximg;
+        scrpriv->buffers[0].pixmap = XCB_NONE;
+        scrpriv->buffers[0].busy = FALSE;
+        RegionNull(&scrpriv->buffers[0].stale);
+        scrpriv->n_buffers = 1;
+    }
+
+    scrpriv->back_buffer = 0;
+
+    /* Frames go straight to the window on the presenter's connection,
+     * and nothing on ours may be ordered against them.  Each screen has
+     * a presenter of its own, kept across screen resets, so screens
+     * upload concurrently.  It puts from the SHM segments of our
+     * connection. */
+    if (HostX.use_presenter_thread && shm_success &&
+        scrpriv->n_buffers > 1 &&
+        !scrpriv->xform_x_dir && !scrpriv->present_events &&
+        !scrpriv->presenter) {
+        scrpriv->presenter = ephyr_presenter_create();
+
+        if (!scrpriv->presenter) {
+            fprintf(stderr, "\nXephyr unable to start the presenter thread "
+                    "for screen %d\n", scrpriv->mynum);
+        }
+    }
+
+    scrpriv->threaded = scrpriv->presenter && shm_success &&
+        scrpriv->n_buffers > 1 &&
+        !scrpriv->xform_x_dir && !scrpriv->present_events;
+
+    /* Present flips its own pixmaps onto the window instead */
+    if (!ephyr_glamor && HostX.use_backing_pixmap &&
+        !scrpriv->xform_x_dir && !scrpriv->present_events &&
+        !scrpriv->threaded) {
+        scrpriv->backing_pixmap = xcb_generate_id(HostX.conn);
+        xcb_create_pixmap(HostX.conn, HostX.depth, scrpriv->backing_pixmap,
+                          scrpriv->win, fb_width, fb_height);
+    }
+
+    /* A new pixmap has undefined content: the next frame puts the whole
+     * fb into it, and exposures are uploaded until then */
+    if (scrpriv->backing_pixmap) {
+        BoxRec box = { 0, 0, fb_width, fb_height };
+
+        RegionReset(&scrpriv->pending_region, &box);
+        scrpriv->backing_valid = FALSE;
+    }
+
+    {
+        uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+        uint32_t values[2] = {width, height};
+        xcb_configure_window(HostX.conn, scrpriv->win, mask, values);
+    }
+
+    if (scrpriv->win_pre_existing == None && !EphyrWantResize) {
+        /* Ask the WM to keep our size static */
+        xcb_size_hints_t size_hints = {0};
+        size_hints.max_width = size_hints.min_width = width;
+        size_hints.max_height = size_hints.min_height = height;
+        size_hints.flags = (XCB_ICCCM_SIZE_HINT_P_MIN_SIZE |
+                            XCB_ICCCM_SIZE_HINT_P_MAX_SIZE);
+        xcb_icccm_set_wm_normal_hints(HostX.conn, scrpriv->win,
+                                      &size_hints);
+    }
+
+    xcb_map_window(HostX.conn, scrpriv->win);
+
+    /* Set explicit window position if it was informed in
+     * -screen option (WxH+X or WxH+X+Y). Otherwise, accept the
+     * position set by WM.
+     * The trick here is putting this code after xcb_map_window() call,
+     * so these values won't be overriden by WM. */
+    if (scrpriv->win_explicit_position) {
+        uint32_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y;
+        uint32_t values[2] = {x, y};
+        xcb_configure_window(HostX.conn, scrpriv->win, mask, values);
+    }
+
+    xcb_aux_sync(HostX.conn);
+
+    scrpriv->win_width = width;
+    scrpriv->win_height = height;
+    scrpriv->win_x = x;
+    scrpriv->win_y = y;
+
+/* XXX: GLAMOR support will be added later. */
+#ifdef GLAMOR
+    if (ephyr_glamor) {
+        *bytes_per_line = 0;
+        *bits_per_pixel = 0;
+        ephyr_glamor_set_window_size(scrpriv->glamor,
+                                     scrpriv->win_width,
+                                     scrpriv->win_height);
+        return NULL;
+    } else
+#endif
+    {
+        unsigned char *fb;
+
+        ximg = scrpriv->buffers[0].ximg;
+
+        if (host_depth_matches_server(scrpriv) && scrpriv->n_buffers == 1) {
+            *bytes_per_line = ximg->stride;
+            *bits_per_pixel = ximg->bpp;
+
+            EPHYR_DBG("Host matches server");
+            fb = ximg->data;
+        } else if (host_depth_matches_server(scrpriv)) {
+            *bytes_per_line = ximg->stride;
+            *bits_per_pixel = ximg->bpp;
+
+            EPHYR_DBG("Host matches server, %d SHM buffers",
+                      scrpriv->n_buffers);
+            scrpriv->fb_data = xallocarray(ximg->stride, buffer_height);
+            fb = scrpriv->fb_data;
+        } else {
+            int bytes_per_pixel = scrpriv->server_depth >> 3;
+            int stride = (fb_width * bytes_per_pixel + 0x3) & ~0x3;
+
+            *bytes_per_line = stride;
+            *bits_per_pixel = scrpriv->server_depth;
+
+            EPHYR_DBG("server bpp %i", bytes_per_pixel);
+            scrpriv->fb_data = xallocarray(stride, buffer_height);
+            fb = scrpriv->fb_data;
+        }
+
+        if (!HostX.merge_pixels) {
+            hostx_calibrate_merge(scrpriv);
+        }
+
+        /* Present shows whole pixmaps, window copies would race with it,
+         * and transformed windows do not have the fb layout */
+        if (HostX.use_scroll_detection && !scrpriv->present_events &&
+            !scrpriv->xform_x_dir && !scrpriv->threaded) {
+            hostx_scroll_init(scrpriv, fb, width, height,
+                              *bytes_per_line, *bits_per_pixel);
+        }
+
+        if (HostX.use_tile_hash && fb) {
+            hostx_tile_init(scrpriv, fb, *bytes_per_line, *bits_per_pixel);
+        }
+
+        return fb;
+    }
+}
+
+static void hostx_paint_debug_rect(ScrnInfoPtr screen,
+                                   int x, int y, int width, int height);
+static void hostx_scroll_save(EphyrScrPriv *scrpriv, RegionPtr region);
+
+/**
+ * Copies one rectangle of the private framebuffer (fb_data) into an
+ * XImage, converting it first if the server depth differs from the host
+ * one.  Does nothing when the framebuffer is the XImage itself.
+ */
+static void
+hostx_update_image(EphyrScrPriv *scrpriv, xcb_image_t *ximg,
+                   int sx, int sy, int width, int height) {
+    if (!scrpriv->fb_data) {
+        return;
+    }
+
+    /* Several SHM buffers: fb_data has the layout of the XImages */
+    if (host_depth_matches_server(scrpriv)) {
+        int y, idx, bytes_per_pixel = ximg->bpp >> 3;
+
+        for (y = sy; y < sy + height; y++) {
+            idx = y * ximg->stride + sx * bytes_per_pixel;
+            memcpy(ximg->data + idx, scrpriv->fb_data + idx,
+                   width * bytes_per_pixel);
+        }
+
+        return;
+    }
+
+    /*
+     * If the depth of the ephyr server is less than that of the host,
+     * the kdrive fb does not point to the ximage data but to a buffer
+     * ( fb_data ), we shift the various bits from this onto the XImage
+     * so they match the host.
+     *
+     * 32bpp hosts, by far the common case, get whole rows converted
+     * straight into the XImage data.
+     */
+    if (ximg->bpp == 32 &&
+        (scrpriv->server_depth == 16 || scrpriv->server_depth == 8)) {
+        int y, bytes_per_pixel = (scrpriv->server_depth >> 3);
+        int stride = (scrpriv->fb_width * bytes_per_pixel + 0x3) & ~0x3;
+        int swap = ximg->byte_order != IMAGE_BYTE_ORDER;
+
+        for (y = sy; y < sy + height; y++) {
+            uint32_t *dst = (uint32_t *) (ximg->data + y * ximg->stride) + sx;
+            unsigned char *src =
+                scrpriv->fb_data + y * stride + sx * bytes_per_pixel;
+
+            if (scrpriv->server_depth == 16) {
+                ephyr_convert_rgb565_row(dst, (uint16_t *) src, width, swap);
+            } else {
+                ephyr_convert_pal8_row(dst, src, width, scrpriv->cmap, swap);
+            }
+        }
+
+        return;
+    }
+
+    /*
+     * Note, This code is pretty new ( and simple ) so may break on
+     *       endian issues etc.
+     *       Not sure if 8bpp case is right either.
+     *       ... and it will be much slower than the row converters.
+     */
+    {
+        int x, y, idx, bytes_per_pixel = (scrpriv->server_depth >> 3);
+        int stride = (scrpriv->fb_width * bytes_per_pixel + 0x3) & ~0x3;
+        unsigned char r, g, b;
+        unsigned long host_pixel;
+
+        EPHYR_DBG("Unmatched host depth scrpriv=%p\n", scrpriv);
+        for (y = sy; y < sy + height; y++) {
+            for (x = sx; x < sx + width; x++) {
+                idx = y * stride + x * bytes_per_pixel;
+
+                switch (scrpriv->server_depth) {
+                case 16:
+                {
+                    unsigned short pixel =
+                        *(unsigned short *) (scrpriv->fb_data + idx);
+
+                    r = ((pixel & 0xf800) >> 8);
+                    g = ((pixel & 0x07e0) >> 3);
+                    b = ((pixel & 0x001f) << 3);
+
+                    host_pixel = (r << 16) | (g << 8) | (b);
+
+                    xcb_image_put_pixel(ximg, x, y, host_pixel);
+                    break;
+                }
+                case 8:
+                {
+                    unsigned char pixel =
+                        *(unsigned char *) (scrpriv->fb_data + idx);
+                    xcb_image_put_pixel(ximg, x, y, scrpriv->cmap[pixel]);
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Regions smaller than this are not worth waking the workers up for */
+#define HOSTX_PARALLEL_MIN_AREA (256 * 256)
+#define HOSTX_STRIPE_MIN_ROWS 16
+
+typedef struct {
+    EphyrScrPriv *scrpriv;
+    xcb_image_t *ximg;
+    BoxPtr stripes;
+} HostXUpdateJob;
+
+static void
+hostx_update_stripe(void *data, int job) {
+    HostXUpdateJob *update = data;
+    BoxPtr stripe = &update->stripes[job];
+
+    hostx_update_image(update->scrpriv, update->ximg,
+                       stripe->x1, stripe->y1,
+                       stripe->x2 - stripe->x1, stripe->y2 - stripe->y1);
+}
+
+/**
+ * Runs hostx_update_image() on every box of region.  With presentation
+ * threads, large regions are cut in horizontal stripes of about the same
+ * size which the workers convert in parallel; we return once they are
+ * all done, so the caller can put the image right away.
+ */
+static void
+hostx_update_region(EphyrScrPriv *scrpriv, xcb_image_t *ximg,
+                    RegionPtr region) {
+    int i, nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    int n_workers = ephyr_workers_count();
+    long area = 0, job_area;
+    int n_stripes = 0;
+    HostXUpdateJob update;
+
+    if (!scrpriv->fb_data) {
+        return;
+    }
+
+    for (i = 0; i < nbox; i++) {
+        area += (long) (pbox[i].x2 - pbox[i].x1) * (pbox[i].y2 - pbox[i].y1);
+    }
+
+    /* A couple of jobs per thread evens out the stripe costs */
+    job_area = area / (2 * (n_workers + 1));
+
+    update.scrpriv = scrpriv;
+    update.ximg = ximg;
+    update.stripes = NULL;
+
+    if (n_workers && area >= HOSTX_PARALLEL_MIN_AREA) {
+        for (i = 0; i < nbox; i++) {
+            int rows = job_area / (pbox[i].x2 - pbox[i].x1);
+
+            rows = rows > HOSTX_STRIPE_MIN_ROWS ? rows : HOSTX_STRIPE_MIN_ROWS;
+            n_stripes += (pbox[i].y2 - pbox[i].y1 + rows - 1) / rows;
+        }
+
+        update.stripes = xallocarray(n_stripes, sizeof(BoxRec));
+    }
+
+    if (!update.stripes) {
+        for (i = 0; i < nbox; i++, pbox++) {
+            hostx_update_image(scrpriv, ximg,
+                               pbox->x1, pbox->y1,
+                               pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        }
+
+        return;
+    }
+
+    n_stripes = 0;
+
+    for (i = 0; i < nbox; i++) {
+        int y, rows = job_area / (pbox[i].x2 - pbox[i].x1);
+
+        rows = rows > HOSTX_STRIPE_MIN_ROWS ? rows : HOSTX_STRIPE_MIN_ROWS;
+
+        for (y = pbox[i].y1; y < pbox[i].y2; y += rows) {
+            BoxPtr stripe = &update.stripes[n_stripes++];
+
+            stripe->x1 = pbox[i].x1;
+            stripe->x2 = pbox[i].x2;
+            stripe->y1 = y;
+            stripe->y2 = y + rows < pbox[i].y2 ? y + rows : pbox[i].y2;
+        }
+    }
+
+    ephyr_workers_run(hostx_update_stripe, &update, n_stripes);
+    free(update.stripes);
+}
+
+/* PutImage header, including the BIG-REQUESTS extended length */
+#define HOSTX_PUT_IMAGE_HEADER 28
+
+/* Rows of a strided PutImage, which takes up to two iovecs each: xcb
+ * hands them all to a single writev(), bounded by IOV_MAX */
+#define HOSTX_PUT_STRIDED_ROWS 256
+
+/**
+ * Sends a PutImage request whose rows are read straight from an image of
+ * another stride.  The protocol wants rows packed to the host scanline
+ * pad, which xcb_put_image() would need a packed copy for; here every
+ * row gets an iovec of its own, followed by its padding bytes.
+ */
+static unsigned int
+hostx_put_image_strided(xcb_drawable_t drawable, uint8_t depth,
+                        const uint8_t *src, int src_stride,
+                        int row_bytes, int stride,
+                        int dx, int dy, int width, int height) {
+    /* xcb may use the two iovecs before the request for its prefix */
+    struct iovec parts[2 + 1 + 2 * HOSTX_PUT_STRIDED_ROWS + 1];
+    struct iovec *vector = parts + 2;
+    xcb_protocol_request_t req = {
+        .ext = NULL,
+        .opcode = XCB_PUT_IMAGE,
+        .isvoid = 1
+    };
+    xcb_put_image_request_t out;
+    size_t len = (size_t) height * stride;
+    int r, n = 0;
+
+    memset(&out, 0, sizeof(out));
+    out.format = XCB_IMAGE_FORMAT_Z_PIXMAP;
+    out.drawable = drawable;
+    out.gc = HostX.gc;
+    out.width = width;
+    out.height = height;
+    out.dst_x = dx;
+    out.dst_y = dy;
+    out.depth = depth;
+
+    vector[n].iov_base = (char *) &out;
+    vector[n++].iov_len = sizeof(out);
+
+    /* NULL iovecs of up to 3 bytes are filled with padding by xcb */
+    for (r = 0; r < height; r++, src += src_stride) {
+        vector[n].iov_base = (char *) src;
+        vector[n++].iov_len = row_bytes;
+
+        if (stride > row_bytes) {
+            vector[n].iov_base = NULL;
+            vector[n++].iov_len = stride - row_bytes;
+        }
+    }
+
+    if (len & 3) {
+        vector[n].iov_base = NULL;
+        vector[n++].iov_len = -len & 3;
+    }
+
+    req.count = n;
+    return xcb_send_request(HostX.conn, 0, vector, &req);
+}
+
+/**
+ * Puts one rectangle of an XImage with plain PutImage requests.  Rows
+ * are sent straight from the image when they need no byte swapping,
+ * strided with hostx_put_image_strided() if the rectangle is narrower
+ * than the image.  Otherwise they go through a scratch buffer kept
+ * across calls.  The rectangle is split in bands that fit in the host's
+ * maximum request length.
+ *
+ * Returns FALSE if the image format is not handled here.  Otherwise the
+ * sequence number of the last request is stored in *sequence.
+ */
+static Bool
+hostx_put_image_rect(xcb_drawable_t drawable, xcb_image_t *ximg,
+                     int sx, int sy, int dx, int dy, int width, int height,
+                     unsigned int *sequence) {
+    const xcb_setup_t *setup = xcb_get_setup(HostX.conn);
+    int cpp = ximg->bpp >> 3;
+    int pad = ximg->scanline_pad >> 3;
+    int stride = (width * cpp + pad - 1) / pad * pad;
+    Bool swap = cpp > 1 && ximg->byte_order != setup->image_byte_order;
+    Bool packed = !swap && stride == ximg->stride && sx == 0;
+    Bool strided = !swap && !packed && stride - width * cpp <= 3;
+    uint32_t max_bytes = xcb_get_maximum_request_length(HostX.conn) * 4;
+    int y, rows = (max_bytes - HOSTX_PUT_IMAGE_HEADER) / stride;
+
+    if (ximg->bpp != 8 && ximg->bpp != 16 && ximg->bpp != 32) {
+        return FALSE;
+    }
+
+    rows = rows > 0 ? rows : 1;
+    rows = rows < height ? rows : height;
+
+    if (strided) {
+        rows = min(rows, HOSTX_PUT_STRIDED_ROWS);
+    } else if (!packed &&
+               HostX.put_scratch_size < (size_t) rows * stride) {
+        free(HostX.put_scratch);
+        HostX.put_scratch_size = 0;
+        HostX.put_scratch = xallocarray(rows, stride);
+
+        if (!HostX.put_scratch) {
+            return FALSE;
+        }
+
+        HostX.put_scratch_size = (size_t) rows * stride;
+    }
+
+    *sequence = 0;
+
+    for (y = 0; y < height; y += rows) {
+        int r, n = rows < height - y ? rows : height - y;
+        uint8_t *src = ximg->data + (sy + y) * ximg->stride + sx * cpp;
+        uint8_t *data = HostX.put_scratch;
+
+        if (strided) {
+            *sequence = hostx_put_image_strided(drawable, ximg->depth,
+                                                src, ximg->stride,
+                                                width * cpp, stride,
+                                                dx, dy + y, width, n);
+            continue;
+        }
+
+        if (packed) {
+            data = src;
+        } else {
+            for (r = 0; r < n; r++, src += ximg->stride) {
+                uint8_t *dst = data + r * stride;
+                int x;
+
+                if (!swap) {
+                    memcpy(dst, src, width * cpp);
+                } else if (cpp == 2) {
+                    for (x = 0; x < width; x++) {
+                        ((uint16_t *) dst)[x] =
+                            lswaps(((uint16_t *) src)[x]);
+                    }
+                } else {
+                    for (x = 0; x < width; x++) {
+                        ((uint32_t *) dst)[x] =
+                            lswapl(((uint32_t *) src)[x]);
+                    }
+                }
+            }
+        }
+
+        *sequence = xcb_put_image(HostX.conn, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                  drawable, HostX.gc,
+                                  width, n, dx, dy + y, 0, ximg->depth,
+                                  n * stride, data).sequence;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Queues the request that puts one rectangle of an XImage on the host
+ * window.  Nothing is flushed or synced here, so callers can batch any
+ * number of rectangles into a single frame.
+ *
+ * If send_event is set and MIT-SHM is in use, the host will send a
+ * ShmCompletion event once it is done reading the segment.  Returns the
+ * sequence number of the put request.
+ */
+static unsigned int
+hostx_put_rect(ScrnInfoPtr screen, EphyrHostBuffer *buffer,
+               int sx, int sy, int dx, int dy, int width, int height,
+               Bool send_event) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    xcb_image_t *ximg = buffer->ximg;
+    xcb_void_cookie_t cookie;
+
+    if (HostX.have_shm) {
+        cookie = xcb_shm_put_image(HostX.conn, hostx_put_drawable(scrpriv),
+                                   HostX.gc,
+                                   ximg->width, ximg->height,
+                                   sx, sy, width, height, dx, dy,
+                                   ximg->depth, ximg->format,
+                                   send_event,
+                                   buffer->shminfo.shmseg,
+                                   ximg->data - buffer->shminfo.shmaddr);
+    } else {
+        unsigned int seq;
+        xcb_image_t *subimg, *img;
+
+        if (hostx_put_image_rect(hostx_put_drawable(scrpriv), ximg,
+                                 sx, sy, dx, dy, width, height, &seq)) {
+            return seq;
+        }
+
+        subimg = xcb_image_subimage(ximg, sx, sy, width, height, 0, 0, 0);
+        img = xcb_image_native(HostX.conn, subimg, 1);
+        cookie = xcb_image_put(HostX.conn, hostx_put_drawable(scrpriv),
+                               HostX.gc, img, dx, dy, 0);
+
+        if (subimg != img) {
+            xcb_image_destroy(img);
+        }
+
+        xcb_image_destroy(subimg);
+    }
+
+    return cookie.sequence;
+}
+
+/* Requests timed to measure the cost of a request alone */
+#define HOSTX_CALIBRATE_REQUESTS 64
+#define HOSTX_CALIBRATE_SIZE 256
+/* Timings are the median of this many runs */
+#define HOSTX_CALIBRATE_RUNS 5
+
+/* Bounds for the calibrated cost of a request, in pixels */
+#define HOSTX_MERGE_MIN_PIXELS 64
+#define HOSTX_MERGE_MAX_PIXELS (64 * 1024)
+
+static int64_t
+hostx_time_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Times a round trip to the host alone */
+static int64_t
+hostx_time_sync(void) {
+    int64_t start = hostx_time_usec();
+
+    xcb_aux_sync(HostX.conn);
+    return hostx_time_usec() - start;
+}
+
+static int
+hostx_compare_time(const void *a, const void *b) {
+    int64_t ta = *(const int64_t *) a, tb = *(const int64_t *) b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+static int64_t
+hostx_median_time(int64_t *times, int n) {
+    qsort(times, n, sizeof(*times), hostx_compare_time);
+    return times[n / 2];
+}
+
+static Bool
+hostx_calibrate_put(EphyrHostBuffer *buffer, xcb_drawable_t drawable,
+                    int x, int y, int width, int height) {
+    xcb_image_t *ximg = buffer->ximg;
+    unsigned int seq;
+
+    if (HostX.have_shm) {
+        xcb_shm_put_image(HostX.conn, drawable, HostX.gc,
+                          ximg->width, ximg->height,
+                          x, y, width, height, x, y,
+                          ximg->depth, ximg->format, FALSE,
+                          buffer->shminfo.shmseg,
+                          ximg->data - buffer->shminfo.shmaddr);
+        return TRUE;
+    }
+
+    return hostx_put_image_rect(drawable, ximg, x, y, x, y,
+                                width, height, &seq);
+}
+
+/**
+ * Measures what a put request costs on the host compared to a pixel:
+ * many tiny puts give the cost of a request, one big put the cost of its
+ * pixels.  They go to a scratch pixmap so that nothing shows, and the
+ * result tells hostx_simplify_boxes() how many extra pixels are worth
+ * saving a request.  The round trip that ends each measurement is timed
+ * on its own and taken off, and every timing is the median of a few
+ * runs, so that one scheduling hiccup does not skew the result.
+ */
+static void
+hostx_calibrate_merge(EphyrScrPriv *scrpriv) {
+    EphyrHostBuffer *buffer = &scrpriv->buffers[0];
+    int width = min(buffer->ximg->width, HOSTX_CALIBRATE_SIZE);
+    int height = min(buffer->ximg->height, HOSTX_CALIBRATE_SIZE);
+    int64_t request_times[HOSTX_CALIBRATE_RUNS];
+    int64_t pixel_times[HOSTX_CALIBRATE_RUNS];
+    int64_t start, sync, requests, pixels;
+    double request_cost, pixel_cost;
+    xcb_pixmap_t pixmap;
+    Bool success = TRUE;
+    int i, run;
+
+    pixmap = xcb_generate_id(HostX.conn);
+    xcb_create_pixmap(HostX.conn, HostX.depth, pixmap, scrpriv->win,
+                      width, height);
+    xcb_aux_sync(HostX.conn);
+
+    for (run = 0; run < HOSTX_CALIBRATE_RUNS && success; run++) {
+        sync = hostx_time_sync();
+
+        start = hostx_time_usec();
+        for (i = 0; i < HOSTX_CALIBRATE_REQUESTS && success; i++) {
+            success = hostx_calibrate_put(buffer, pixmap,
+                                          i % width, i / width % height,
+                                          1, 1);
+        }
+        xcb_aux_sync(HostX.conn);
+        request_times[run] = max(hostx_time_usec() - start - sync, 0);
+
+        start = hostx_time_usec();
+        success = success &&
+            hostx_calibrate_put(buffer, pixmap, 0, 0, width, height);
+        xcb_aux_sync(HostX.conn);
+        pixel_times[run] = max(hostx_time_usec() - start - sync, 0);
+    }
+
+    xcb_free_pixmap(HostX.conn, pixmap);
+
+    if (!success) {
+        HostX.merge_pixels = HOSTX_MERGE_MIN_PIXELS;
+        return;
+    }
+
+    requests = hostx_median_time(request_times, HOSTX_CALIBRATE_RUNS);
+    pixels = hostx_median_time(pixel_times, HOSTX_CALIBRATE_RUNS);
+    request_cost = (double) requests / HOSTX_CALIBRATE_REQUESTS;
+    pixel_cost = (pixels - request_cost) / ((double) width * height);
+
+    /* Too fast to time against the round trip: stay conservative */
+    if (pixels <= 0 || pixel_cost <= 0) {
+        EPHYR_DBG("calibration measured nothing, merging up to %d pixels\n",
+                  HOSTX_MERGE_MIN_PIXELS);
+        HostX.merge_pixels = HOSTX_MERGE_MIN_PIXELS;
+        return;
+    }
+
+    if (pixel_cost * HOSTX_MERGE_MAX_PIXELS <= request_cost) {
+        HostX.merge_pixels = HOSTX_MERGE_MAX_PIXELS;
+    } else {
+        HostX.merge_pixels = max((long) (request_cost / pixel_cost),
+                                 HOSTX_MERGE_MIN_PIXELS);
+    }
+
+    EPHYR_DBG("request costs %.1fus, pixel %.4fus: merging up to %ld pixels\n",
+              request_cost, pixel_cost, HostX.merge_pixels);
+}
+
+static int64_t
+hostx_box_area(const BoxRec *box) {
+    return (int64_t) (box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+/* Recently merged boxes that a new box is tried against */
+#define HOSTX_MERGE_WINDOW 8
+
+/**
+ * Merges the boxes of region into fewer, larger ones as long as the
+ * pixels a merge adds cost less than the request it saves.  The boxes
+ * returned in *boxes may overlap and cover more than region, which is
+ * fine to put since the whole image is up to date; they must be freed
+ * if they are not RegionRects(region).  Returns how many there are.
+ */
+static int
+hostx_simplify_boxes(RegionPtr region, BoxPtr *boxes) {
+    int nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    BoxPtr merged;
+    int i, j, n = 0;
+
+    *boxes = pbox;
+
+    if (nbox < 2 || !HostX.merge_pixels) {
+        return nbox;
+    }
+
+    merged = xallocarray(nbox, sizeof(BoxRec));
+    if (!merged) {
+        return nbox;
+    }
+
+    for (i = 0; i < nbox; i++) {
+        BoxRec box = pbox[i];
+
+        /* Once merged, the box may pay off with more of its neighbours */
+        for (j = n - 1; j >= 0 && j >= n - HOSTX_MERGE_WINDOW; j--) {
+            BoxRec bounds, overlap;
+            int64_t extra;
+
+            bounds.x1 = min(box.x1, merged[j].x1);
+            bounds.y1 = min(box.y1, merged[j].y1);
+            bounds.x2 = max(box.x2, merged[j].x2);
+            bounds.y2 = max(box.y2, merged[j].y2);
+
+            overlap.x1 = max(box.x1, merged[j].x1);
+            overlap.y1 = max(box.y1, merged[j].y1);
+            overlap.x2 = max(min(box.x2, merged[j].x2), overlap.x1);
+            overlap.y2 = max(min(box.y2, merged[j].y2), overlap.y1);
+
+            extra = hostx_box_area(&bounds) - hostx_box_area(&box) -
+                hostx_box_area(&merged[j]) + hostx_box_area(&overlap);
+
+            if (extra < HostX.merge_pixels) {
+                box = bounds;
+                memmove(&merged[j], &merged[j + 1],
+                        (n - j - 1) * sizeof(BoxRec));
+                n--;
+                j = n;
+            }
+        }
+
+        merged[n++] = box;
+    }
+
+    *boxes = merged;
+    return n;
+}
+
+/**
+ * hostx_process_event handles host events that only matter to the
+ * presentation code, such as MIT-SHM completion notifications.
+ *
+ * Returns TRUE if the event was consumed and must not be processed any
+ * further by the caller.
+ */
+Bool
+hostx_process_event(xcb_generic_event_t *xev) {
+    if (HostX.have_shm &&
+        (xev->response_type & 0x7f) ==
+        HostX.shm_first_event + XCB_SHM_COMPLETION) {
+        xcb_shm_completion_event_t *completion =
+            (xcb_shm_completion_event_t *) xev;
+        int index;
+
+        for (index = 0; index < HostX.n_screens; index++) {
+            EphyrScrPriv *scrpriv = HostX.screens[index]->driverPrivate;
+
+            if (hostx_put_drawable(scrpriv) == completion->drawable) {
+                hostx_complete_frames(scrpriv, xev->full_sequence);
+                break;
+            }
+        }
+
+        return TRUE;
+    }
+
+    if (HostX.xkb_first_event &&
+        (xev->response_type & 0x7f) == HostX.xkb_first_event) {
+        xcb_xkb_map_notify_event_t *notify =
+            (xcb_xkb_map_notify_event_t *) xev;
+
+        if (notify->xkbType == XCB_XKB_MAP_NOTIFY) {
+            hostx_update_key_classes();
+        }
+
+        return TRUE;
+    }
+
+    switch (xev->response_type & 0x7f) {
+    case XCB_MAPPING_NOTIFY: {
+        xcb_mapping_notify_event_t *mapping =
+            (xcb_mapping_notify_event_t *) xev;
+
+        if (mapping->request == XCB_MAPPING_KEYBOARD) {
+            hostx_update_key_classes();
+        }
+
+        return TRUE;
+    }
+    case XCB_GRAPHICS_EXPOSURE: {
+        xcb_graphics_exposure_event_t *exposure =
+            (xcb_graphics_exposure_event_t *) xev;
+        int index;
+
+        /* Part of a scroll source was obscured, upload it instead */
+        for (index = 0; index < HostX.n_screens; index++) {
+            ScrnInfoPtr screen = HostX.screens[index];
+            EphyrScrPriv *scrpriv = screen->driverPrivate;
+
+            if (scrpriv->win == exposure->drawable) {
+                hostx_add_exposure(screen, exposure->x, exposure->y,
+                                   exposure->width, exposure->height);
+                hostx_paint_exposures(screen);
+                break;
+            }
+        }
+
+        return TRUE;
+    }
+    case XCB_NO_EXPOSURE:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+void
+hostx_paint_rect(ScrnInfoPtr screen,
+                 int sx, int sy, int dx, int dy, int width, int height) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    EphyrHostBuffer *buffer = &scrpriv->buffers[0];
+
+    EPHYR_DBG("painting in screen %d\n", scrpriv->mynum);
+
+/* XXX: GLAMOR support will be added later. */
+#ifdef GLAMOR
+    if (ephyr_glamor) {
+        BoxRec box;
+        RegionRec region;
+
+        box.x1 = dx;
+        box.y1 = dy;
+        box.x2 = dx + width;
+        box.y2 = dy + height;
+
+        RegionInit(&region, &box, 1);
+        ephyr_glamor_damage_redisplay(scrpriv->glamor, &region);
+        RegionUninit(&region);
+        return;
+    }
+#endif
+
+    /* The SHM buffers only hold copies of the fb, go through the ring;
+     * tile hashes must see what the host receives too */
+    if ((scrpriv->n_buffers > 1 || scrpriv->tile_hashes) &&
+        sx == dx && sy == dy) {
+        BoxRec box;
+        RegionRec region;
+
+        box.x1 = dx;
+        box.y1 = dy;
+        box.x2 = dx + width;
+        box.y2 = dy + height;
+
+        RegionInit(&region, &box, 1);
+        hostx_paint_region(screen, &region);
+        RegionUninit(&region);
+        return;
+    }
+
+    /*
+     *  Copy the image data updated by the shadow layer
+     *  on to the window
+     */
+    if (HostXWantDamageDebug) {
+        hostx_paint_debug_rect(screen, dx, dy, width, height);
+    }
+
+    if (scrpriv->n_buffers > 1) {
+        hostx_wait_frames(scrpriv);
+        hostx_wait_presented(buffer);
+    }
+
+    hostx_update_image(scrpriv, buffer->ximg, sx, sy, width, height);
+    hostx_put_rect(screen, buffer, sx, sy, dx, dy, width, height, FALSE);
+
+    if (scrpriv->backing_pixmap) {
+        BoxRec box = { dx, dy, dx + width, dy + height };
+        RegionRec region;
+
+        RegionInit(&region, &box, 1);
+        hostx_show_region(scrpriv, &region);
+        RegionUninit(&region);
+    }
+
+    xcb_aux_sync(HostX.conn);
+
+    if (scrpriv->scroll_prev) {
+        BoxRec box = { dx, dy, dx + width, dy + height };
+        RegionRec region;
+
+        RegionInit(&region, &box, 1);
+
+        if (sx == dx && sy == dy) {
+            hostx_scroll_save(scrpriv, &region);
+        } else {
+            RegionSubtract(&scrpriv->scroll_known, &scrpriv->scroll_known,
+                           &region);
+        }
+
+        RegionUninit(&region);
+    }
+}
+
+/**
+ * Brings the back buffer up to date with everything the fb received
+ * since it was last used, including region, which becomes stale in all
+ * the other buffers.
+ */
+static void
+hostx_update_back_buffer(EphyrScrPriv *scrpriv, RegionPtr region) {
+    EphyrHostBuffer *back = &scrpriv->buffers[scrpriv->back_buffer];
+    int i;
+
+    RegionUnion(&back->stale, &back->stale, region);
+    hostx_update_region(scrpriv, back->ximg, &back->stale);
+    RegionEmpty(&back->stale);
+
+    for (i = 0; i < scrpriv->n_buffers; i++) {
+        if (i != scrpriv->back_buffer) {
+            RegionUnion(&scrpriv->buffers[i].stale,
+                        &scrpriv->buffers[i].stale, region);
+        }
+    }
+}
+
+/**
+ * Presents a frame through the ring of SHM buffers: the back buffer is
+ * updated with region but only put is sent, and the buffer stays busy
+ * until the host sends the ShmCompletion event for the frame.  We only
+ * wait when the whole ring is still in flight.
+ */
+static void
+hostx_paint_region_buffered(ScrnInfoPtr screen, RegionPtr region,
+                            RegionPtr put) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    EphyrHostBuffer *back = &scrpriv->buffers[scrpriv->back_buffer];
+    unsigned int seq = 0;
+    BoxPtr boxes, pbox;
+    int nbox;
+
+    if (back->busy) {
+        hostx_wait_frames(scrpriv);
+    }
+
+    hostx_update_back_buffer(scrpriv, region);
+
+    nbox = hostx_simplify_boxes(put, &boxes);
+    pbox = boxes;
+
+    if (!nbox) {
+        xcb_flush(HostX.conn);
+        return;
+    }
+
+    while (nbox--) {
+        if (HostXWantDamageDebug) {
+            hostx_paint_debug_rect(screen, pbox->x1, pbox->y1,
+                                   pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        }
+
+        seq = hostx_put_rect(screen, back,
+                             pbox->x1, pbox->y1,
+                             pbox->x1, pbox->y1,
+                             pbox->x2 - pbox->x1, pbox->y2 - pbox->y1,
+                             nbox == 0);
+        pbox++;
+    }
+
+    if (boxes != RegionRects(put)) {
+        free(boxes);
+    }
+
+    hostx_show_region(scrpriv, region);
+
+    back->busy = TRUE;
+    back->busy_seq = seq;
+    scrpriv->back_buffer = (scrpriv->back_buffer + 1) % scrpriv->n_buffers;
+
+    xcb_flush(HostX.conn);
+}
+
+/**
+ * Presents a frame through the presenter thread: the back buffer is
+ * updated with region and handed over with the boxes to put.  Instead of
+ * waiting when the back buffer or the ring are still busy, the damage is
+ * kept for a frame retried by hostx_presenter_done() once the presenter
+ * made progress.
+ */
+static void
+hostx_paint_region_threaded(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    EphyrHostBuffer *back = &scrpriv->buffers[scrpriv->back_buffer];
+    EphyrPresentFrame frame;
+    BoxPtr boxes;
+    int nbox;
+
+    if (__atomic_load_n(&back->presenting, __ATOMIC_ACQUIRE)) {
+        goto retry;
+    }
+
+    hostx_update_back_buffer(scrpriv, region);
+
+    /* The presenter frees the boxes, it needs its own copy of them */
+    nbox = hostx_simplify_boxes(region, &boxes);
+
+    if (boxes == RegionRects(region)) {
+        boxes = xallocarray(nbox, sizeof(BoxRec));
+
+        if (!boxes) {
+            goto retry;
+        }
+
+        memcpy(boxes, RegionRects(region), nbox * sizeof(BoxRec));
+    }
+
+    frame.window = scrpriv->win;
+    frame.shmseg = back->shminfo.shmseg;
+    frame.offset = back->ximg->data - back->shminfo.shmaddr;
+    frame.image_width = back->ximg->width;
+    frame.image_height = back->ximg->height;
+    frame.depth = back->ximg->depth;
+    frame.boxes = boxes;
+    frame.n_boxes = nbox;
+    frame.busy = &back->presenting;
+
+    back->presenting = TRUE;
+
+    if (!ephyr_presenter_push(scrpriv->presenter, &frame)) {
+        back->presenting = FALSE;
+        free(boxes);
+        goto retry;
+    }
+
+    scrpriv->back_buffer = (scrpriv->back_buffer + 1) % scrpriv->n_buffers;
+    return;
+
+ retry:
+    RegionUnion(&scrpriv->pending_region, &scrpriv->pending_region, region);
+    scrpriv->presenter_retry = TRUE;
+}
+
+/**
+ * Presents a frame by flipping the back buffer's pixmap with the Present
+ * extension, limiting the copy to the damaged region.  Frames are aimed
+ * at successive host vblanks; we wait for CompleteNotify when too many
+ * are queued, and for IdleNotify before touching a pixmap the host
+ * still shows.
+ */
+static void
+hostx_paint_region_present(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    EphyrHostBuffer *back = &scrpriv->buffers[scrpriv->back_buffer];
+    int max_frames = HostX.max_frames_in_flight > 0 ?
+        HostX.max_frames_in_flight : 1;
+    int i, nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    xcb_rectangle_t *rects;
+
+    hostx_present_drain_events(scrpriv);
+
+    while (back->busy || scrpriv->frames_in_flight >= max_frames) {
+        xcb_generic_event_t *ev =
+            xcb_wait_for_special_event(HostX.conn, scrpriv->present_events);
+
+        if (!ev) {
+            /* The connection is gone, nothing will ever complete */
+            hostx_wait_frames(scrpriv);
+            break;
+        }
+
+        hostx_present_handle_event(scrpriv,
+                                   (xcb_present_generic_event_t *) ev);
+    }
+
+    hostx_update_back_buffer(scrpriv, region);
+
+    rects = xallocarray(nbox, sizeof(xcb_rectangle_t));
+
+    for (i = 0; i < nbox; i++, pbox++) {
+        if (HostXWantDamageDebug) {
+            hostx_paint_debug_rect(screen, pbox->x1, pbox->y1,
+                                   pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        }
+
+        rects[i].x = pbox->x1;
+        rects[i].y = pbox->y1;
+        rects[i].width = pbox->x2 - pbox->x1;
+        rects[i].height = pbox->y2 - pbox->y1;
+    }
+
+    xcb_xfixes_set_region(HostX.conn, scrpriv->present_update, nbox, rects);
+    free(rects);
+
+    xcb_present_pixmap(HostX.conn, scrpriv->win, back->pixmap,
+                       ++scrpriv->present_serial,
+                       XCB_NONE, scrpriv->present_update, 0, 0,
+                       XCB_NONE, XCB_NONE, XCB_NONE,
+                       XCB_PRESENT_OPTION_NONE,
+                       scrpriv->present_msc + scrpriv->frames_in_flight + 1,
+                       0, 0, 0, NULL);
+
+    back->busy = TRUE;
+    scrpriv->frames_in_flight++;
+    scrpriv->back_buffer = (scrpriv->back_buffer + 1) % scrpriv->n_buffers;
+
+    xcb_flush(HostX.conn);
+}
+
+/* Scrolls shorter than this are cheaper to upload than to look for */
+#define HOSTX_SCROLL_MIN_SIZE 64
+#define HOSTX_SCROLL_MIN_RUN 16
+
+static inline uint32_t
+hostx_scroll_pixel(const unsigned char *p, int cpp) {
+    switch (cpp) {
+    case 4:
+        return *(const uint32_t *) p;
+    case 2:
+        return *(const uint16_t *) p;
+    default:
+        return *p;
+    }
+}
+
+static void
+hostx_scroll_hash_rows(EphyrScrPriv *scrpriv, const unsigned char *fb,
+                       BoxPtr box, uint64_t *hashes) {
+    int y, cpp = scrpriv->scroll_cpp;
+
+    for (y = box->y1; y < box->y2; y++) {
+        hashes[y - box->y1] =
+            ephyr_hash_bytes(fb + y * scrpriv->scroll_stride + box->x1 * cpp,
+                             (box->x2 - box->x1) * cpp);
+    }
+}
+
+static void
+hostx_scroll_hash_columns(EphyrScrPriv *scrpriv, const unsigned char *fb,
+                          BoxPtr box, uint64_t *hashes) {
+    int x, y, cpp = scrpriv->scroll_cpp, width = box->x2 - box->x1;
+
+    for (x = 0; x < width; x++) {
+        hashes[x] = EPHYR_HASH_PRIME;
+    }
+
+    /* Row by row, to walk the framebuffer in memory order */
+    for (y = box->y1; y < box->y2; y++) {
+        const unsigned char *row =
+            fb + y * scrpriv->scroll_stride + box->x1 * cpp;
+
+        for (x = 0; x < width; x++) {
+            hashes[x] = ephyr_hash_mix(hashes[x],
+                                       hostx_scroll_pixel(row + x * cpp, cpp));
+        }
+    }
+}
+
+/**
+ * Finds the longest run [start, end) of lines such that cur[i] equals
+ * prev[i + shift], with a non null shift.  Candidate shifts come from a
+ * few sample lines, skipping those that did not change or look like
+ * their neighbours, as uniform areas would match at any shift.
+ */
+static Bool
+hostx_scroll_find_shift(const uint64_t *prev, const uint64_t *cur, int n,
+                        int *shift, int *start, int *end) {
+    int sample, best = 0;
+
+    for (sample = 1; sample <= 3; sample++) {
+        int i = n * sample / 4, j;
+
+        if (cur[i] == prev[i] || cur[i] == cur[i - 1] ||
+            (i + 1 < n && cur[i] == cur[i + 1])) {
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            int a, b, d = j - i;
+
+            if (j == i || prev[j] != cur[i]) {
+                continue;
+            }
+
+            for (a = i; a > 0 && a - 1 + d >= 0 &&
+                 cur[a - 1] == prev[a - 1 + d]; a--)
+                ;
+            for (b = i + 1; b < n && b + d < n && cur[b] == prev[b + d]; b++)
+                ;
+
+            if (b - a > best) {
+                best = b - a;
+                *shift = d;
+                *start = a;
+                *end = b;
+            }
+        }
+    }
+
+    return best >= HOSTX_SCROLL_MIN_RUN && best >= n / 4;
+}
+
+/**
+ * Looks for a part of the damage extents that only moved, vertically or
+ * horizontally, since the previous frame.  On success, copy is where the
+ * moved area now is in the window and (dx, dy) the offset to where it
+ * was, which must be known to be on the host window already.
+ */
+static Bool
+hostx_scroll_detect(EphyrScrPriv *scrpriv, BoxPtr extents,
+                    BoxPtr copy, int *dx, int *dy) {
+    int width = extents->x2 - extents->x1;
+    int height = extents->y2 - extents->y1;
+    uint64_t *prev = scrpriv->scroll_hashes;
+    uint64_t *cur = prev + scrpriv->scroll_max_lines;
+    int shift, start, end;
+    BoxRec src;
+
+    if (width < HOSTX_SCROLL_MIN_SIZE || height < HOSTX_SCROLL_MIN_SIZE) {
+        return FALSE;
+    }
+
+    hostx_scroll_hash_rows(scrpriv, scrpriv->scroll_prev, extents, prev);
+    hostx_scroll_hash_rows(scrpriv, scrpriv->scroll_fb, extents, cur);
+
+    if (hostx_scroll_find_shift(prev, cur, height, &shift, &start, &end)) {
+        copy->x1 = extents->x1;
+        copy->x2 = extents->x2;
+        copy->y1 = extents->y1 + start;
+        copy->y2 = extents->y1 + end;
+        *dx = 0;
+        *dy = shift;
+    } else {
+        hostx_scroll_hash_columns(scrpriv, scrpriv->scroll_prev, extents, prev);
+        hostx_scroll_hash_columns(scrpriv, scrpriv->scroll_fb, extents, cur);
+
+        if (!hostx_scroll_find_shift(prev, cur, width,
+                                     &shift, &start, &end)) {
+            return FALSE;
+        }
+
+        copy->x1 = extents->x1 + start;
+        copy->x2 = extents->x1 + end;
+        copy->y1 = extents->y1;
+        copy->y2 = extents->y2;
+        *dx = shift;
+        *dy = 0;
+    }
+
+    src.x1 = copy->x1 + *dx;
+    src.x2 = copy->x2 + *dx;
+    src.y1 = copy->y1 + *dy;
+    src.y2 = copy->y2 + *dy;
+
+    return RegionContainsRect(&scrpriv->scroll_known, &src) == rgnIN;
+}
+
+/**
+ * Moves the scrolled part of the damage within the host window with a
+ * CopyArea, and returns in put what is left to upload.  Parts of the
+ * source the host cannot copy come back as GraphicsExposure events.
+ */
+static Bool
+hostx_paint_scroll(ScrnInfoPtr screen, RegionPtr region, RegionPtr put) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    RegionRec moved;
+    BoxRec copy;
+    int dx, dy;
+
+    if (!hostx_scroll_detect(scrpriv, RegionExtents(region),
+                             &copy, &dx, &dy)) {
+        return FALSE;
+    }
+
+    EPHYR_DBG("scroll by %d,%d on screen %d", dx, dy, scrpriv->mynum);
+
+    if (scrpriv->backing_pixmap) {
+        /* The backing pixmap always has the source, nothing to expose */
+        xcb_copy_area(HostX.conn, scrpriv->backing_pixmap,
+                      scrpriv->backing_pixmap, HostX.show_gc,
+                      copy.x1 + dx, copy.y1 + dy, copy.x1, copy.y1,
+                      copy.x2 - copy.x1, copy.y2 - copy.y1);
+    } else {
+        xcb_copy_area(HostX.conn, scrpriv->win, scrpriv->win, HostX.copy_gc,
+                      copy.x1 + dx, copy.y1 + dy, copy.x1, copy.y1,
+                      copy.x2 - copy.x1, copy.y2 - copy.y1);
+    }
+
+    RegionInit(&moved, &copy, 1);
+    RegionNull(put);
+    RegionSubtract(put, region, &moved);
+    RegionUninit(&moved);
+    return TRUE;
+}
+
+/**
+ * Records what region of the host window now shows, for the next
+ * frame's scroll detection.
+ */
+static void
+hostx_scroll_save(EphyrScrPriv *scrpriv, RegionPtr region) {
+    int nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    int y, cpp = scrpriv->scroll_cpp;
+
+    for (; nbox--; pbox++) {
+        for (y = pbox->y1; y < pbox->y2; y++) {
+            int offset = y * scrpriv->scroll_stride + pbox->x1 * cpp;
+
+            memcpy(scrpriv->scroll_prev + offset, scrpriv->scroll_fb + offset,
+                   (pbox->x2 - pbox->x1) * cpp);
+        }
+    }
+
+    RegionUnion(&scrpriv->scroll_known, &scrpriv->scroll_known, region);
+}
+
+/* Solid color detection works on tiles aligned on this grid */
+#define HOSTX_FILL_TILE_SIZE 32
+
+typedef struct {
+    uint32_t pixel;
+    xcb_rectangle_t rect;
+} HostXFill;
+
+static int
+hostx_fill_compare(const void *a, const void *b) {
+    const HostXFill *fa = a, *fb = b;
+
+    return fa->pixel < fb->pixel ? -1 : fa->pixel > fb->pixel;
+}
+
+/**
+ * Tells whether the given area of an XImage is of a single color, and
+ * returns that color as a host pixel value.
+ */
+static Bool
+hostx_area_is_solid(xcb_image_t *ximg, int x, int y, int width, int height,
+                    uint32_t *pixel) {
+    int i, cpp = ximg->bpp >> 3;
+    uint8_t *first = ximg->data + y * ximg->stride + x * cpp;
+
+    switch (ximg->bpp) {
+    case 32:
+        for (i = 1; i < width; i++) {
+            if (((uint32_t *) first)[i] != *(uint32_t *) first) {
+                return FALSE;
+            }
+        }
+        break;
+    case 16:
+        for (i = 1; i < width; i++) {
+            if (((uint16_t *) first)[i] != *(uint16_t *) first) {
+                return FALSE;
+            }
+        }
+        break;
+    case 8:
+        for (i = 1; i < width; i++) {
+            if (first[i] != *first) {
+                return FALSE;
+            }
+        }
+        break;
+    default:
+        return FALSE;
+    }
+
+    /* The other rows must match the first one */
+    for (i = 1; i < height; i++) {
+        if (memcmp(first + i * ximg->stride, first, width * cpp)) {
+            return FALSE;
+        }
+    }
+
+    *pixel = xcb_image_get_pixel(ximg, x, y);
+    return TRUE;
+}
+
+/**
+ * Sends the tiles of region that are of a single color as rectangle
+ * fills, batched into one PolyFillRectangle per color, and returns in
+ * rest the part of region that still needs to be put as an image.
+ * Solid tiles next to each other on a row are merged.
+ */
+static Bool
+hostx_paint_solid_tiles(ScrnInfoPtr screen, xcb_image_t *ximg,
+                        RegionPtr region, RegionPtr rest) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    int nbox = RegionNumRects(region);
+    BoxPtr pbox = RegionRects(region);
+    HostXFill *fills = NULL;
+    xcb_rectangle_t *rects;
+    int i, first, n_fills = 0, size = 0, max_rects;
+    RegionPtr solid;
+
+    for (; nbox--; pbox++) {
+        int tx, ty;
+
+        for (ty = pbox->y1 - pbox->y1 % HOSTX_FILL_TILE_SIZE; ty < pbox->y2;
+             ty += HOSTX_FILL_TILE_SIZE) {
+            int y1 = max(ty, pbox->y1);
+            int y2 = min(ty + HOSTX_FILL_TILE_SIZE, pbox->y2);
+
+            for (tx = pbox->x1 - pbox->x1 % HOSTX_FILL_TILE_SIZE;
+                 tx < pbox->x2; tx += HOSTX_FILL_TILE_SIZE) {
+                int x1 = max(tx, pbox->x1);
+                int x2 = min(tx + HOSTX_FILL_TILE_SIZE, pbox->x2);
+                HostXFill *last = n_fills ? &fills[n_fills - 1] : NULL;
+                uint32_t pixel;
+
+                if (!hostx_area_is_solid(ximg, x1, y1, x2 - x1, y2 - y1,
+                                         &pixel)) {
+                    continue;
+                }
+
+                if (last && last->pixel == pixel && last->rect.y == y1 &&
+                    last->rect.height == y2 - y1 &&
+                    last->rect.x + last->rect.width == x1) {
+                    last->rect.width += x2 - x1;
+                    continue;
+                }
+
+                if (n_fills == size) {
+                    HostXFill *grown;
+
+                    size = size ? size * 2 : 64;
+                    grown = reallocarray(fills, size, sizeof(HostXFill));
+
+                    if (!grown) {
+                        free(fills);
+                        return FALSE;
+                    }
+
+                    fills = grown;
+                }
+
+                fills[n_fills].pixel = pixel;
+                fills[n_fills].rect.x = x1;
+                fills[n_fills].rect.y = y1;
+                fills[n_fills].rect.width = x2 - x1;
+                fills[n_fills].rect.height = y2 - y1;
+                n_fills++;
+            }
+        }
+    }
+
+    rects = n_fills ? xallocarray(n_fills, sizeof(xcb_rectangle_t)) : NULL;
+
+    if (!rects) {
+        free(fills);
+        return FALSE;
+    }
+
+    qsort(fills, n_fills, sizeof(HostXFill), hostx_fill_compare);
+
+    for (i = 0; i < n_fills; i++) {
+        rects[i] = fills[i].rect;
+    }
+
+    if (!HostX.fill_gc) {
+        HostX.fill_gc = xcb_generate_id(HostX.conn);
+        xcb_create_gc(HostX.conn, HostX.fill_gc, HostX.winroot, 0, NULL);
+    }
+
+    /* Request length is in 4 byte units, with a 3 unit header */
+    max_rects = (xcb_get_maximum_request_length(HostX.conn) - 3) / 2;
+
+    for (first = 0; first < n_fills; first = i) {
+        uint32_t pixel = fills[first].pixel;
+
+        for (i = first + 1;
+             i < n_fills && fills[i].pixel == pixel && i - first < max_rects;
+             i++)
+            ;
+
+        xcb_change_gc(HostX.conn, HostX.fill_gc, XCB_GC_FOREGROUND, &pixel);
+        xcb_poly_fill_rectangle(HostX.conn, hostx_put_drawable(scrpriv),
+                                HostX.fill_gc,
+                                i - first, rects + first);
+    }
+
+    EPHYR_DBG("filled %d solid areas on screen %d", n_fills, scrpriv->mynum);
+
+    /* xRectangle and xcb_rectangle_t share the same layout */
+    solid = RegionFromRects(n_fills, (xRectangle *) rects, CT_NONE);
+    RegionNull(rest);
+    RegionSubtract(rest, region, solid);
+    RegionDestroy(solid);
+
+    free(rects);
+    free(fills);
+    return TRUE;
+}
+
+/**
+ * Single buffer presentation: the whole region is converted into the
+ * XImage, only put is sent to the host.  Without MIT-SHM, every byte
+ * goes through the wire, so solid areas are sent as fills.
+ */
+static void
+hostx_paint_region_single(ScrnInfoPtr screen, RegionPtr region,
+                          RegionPtr put) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    EphyrHostBuffer *buffer = &scrpriv->buffers[0];
+    RegionRec images;
+    RegionPtr puts = put;
+    BoxPtr boxes, pbox;
+    int nbox;
+    Bool want_completion = HostX.async_present && HostX.have_shm &&
+        RegionNotEmpty(put);
+    Bool filled = FALSE;
+    unsigned int seq = 0;
+
+    if (want_completion &&
+        scrpriv->frames_in_flight >= HostX.max_frames_in_flight) {
+        hostx_wait_frames(scrpriv);
+    }
+
+    hostx_update_region(scrpriv, buffer->ximg, region);
+
+    if (!HostX.have_shm) {
+        filled = hostx_paint_solid_tiles(screen, buffer->ximg, put, &images);
+
+        if (filled) {
+            puts = &images;
+        }
+    }
+
+    nbox = hostx_simplify_boxes(puts, &boxes);
+    pbox = boxes;
+
+    while (nbox--) {
+        if (HostXWantDamageDebug) {
+            hostx_paint_debug_rect(screen, pbox->x1, pbox->y1,
+                                   pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        }
+
+        seq = hostx_put_rect(screen, buffer,
+                             pbox->x1, pbox->y1,
+                             pbox->x1, pbox->y1,
+                             pbox->x2 - pbox->x1, pbox->y2 - pbox->y1,
+                             want_completion && nbox == 0);
+        pbox++;
+    }
+
+    if (boxes != RegionRects(puts)) {
+        free(boxes);
+    }
+
+    hostx_show_region(scrpriv, region);
+
+    if (filled) {
+        RegionUninit(&images);
+    }
+
+    if (!HostX.async_present) {
+        xcb_aux_sync(HostX.conn);
+        return;
+    }
+
+    if (want_completion) {
+        scrpriv->frame_seq[scrpriv->frames_in_flight++] = seq;
+    }
+
+    xcb_flush(HostX.conn);
+}
+
+/**
+ * hostx_paint_damage presents a whole frame worth of damage at once.
+ *
+ * Every box of the region is queued with hostx_put_rect() and the host
+ * is synced a single time at the end, instead of once per box as with
+ * hostx_paint_rect().  The region is in framebuffer coordinates, which
+ * are the same as the host window ones.
+ *
+ * In asynchronous mode the frame is only flushed: the last SHM put asks
+ * for a completion event, which ephyrPoll() hands back to us, and we only
+ * block when max_frames_in_flight frames are still waiting for one.
+ *
+ * With scroll detection, content that only moved since the previous
+ * frame is copied within the host window rather than uploaded again.
+ */
+static void
+hostx_paint_damage(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    RegionPtr put = region;
+    RegionRec scrolled;
+
+    if (!RegionNumRects(region)) {
+        return;
+    }
+
+    EPHYR_DBG("painting %d boxes in screen %d\n",
+              RegionNumRects(region), scrpriv->mynum);
+
+/* XXX: GLAMOR support will be added later. */
+#ifdef GLAMOR
+    if (ephyr_glamor) {
+        ephyr_glamor_damage_redisplay(scrpriv->glamor, region);
+        return;
+    }
+#endif
+
+    if (scrpriv->present_events) {
+        hostx_paint_region_present(screen, region);
+        return;
+    }
+
+    if (scrpriv->threaded) {
+        hostx_paint_region_threaded(screen, region);
+        return;
+    }
+
+    if (scrpriv->scroll_prev && hostx_paint_scroll(screen, region, &scrolled)) {
+        put = &scrolled;
+    }
+
+    if (scrpriv->n_buffers > 1) {
+        hostx_paint_region_buffered(screen, region, put);
+    } else {
+        hostx_paint_region_single(screen, region, put);
+    }
+
+    if (scrpriv->scroll_prev) {
+        hostx_scroll_save(scrpriv, region);
+    }
+
+    if (put != region) {
+        RegionUninit(put);
+    }
+}
+
+/**
+ * Paints region with hostx_paint_damage(), along with what was exposed or
+ * deferred since the last frame, so that it all goes in one frame.
+ */
+static void
+hostx_paint_frame(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    RegionRec merged;
+
+    if (scrpriv->frame_pending) {
+        TimerCancel(scrpriv->frame_timer);
+        scrpriv->frame_pending = FALSE;
+    }
 
-static int
-hostx_calculate_color_shift(unsigned long mask) {
-    int shift = 1;
+    scrpriv->presenter_retry = FALSE;
+    scrpriv->last_frame = GetTimeInMillis();
 
-    /* count # of bits in mask */
-    while ((mask = (mask >> 1))) {
-        shift++;
+    if (!RegionNotEmpty(&scrpriv->pending_region)) {
+        hostx_paint_damage(screen, region);
+        return;
     }
 
-    /* cmap entry is an unsigned char so adjust it by size of that */
-    shift = shift - sizeof(unsigned char) * 8;
+    RegionNull(&merged);
+    RegionUnion(&merged, region, &scrpriv->pending_region);
+    RegionEmpty(&scrpriv->pending_region);
 
-    if (shift < 0) {
-        shift = 0;
-    }
+    hostx_paint_damage(screen, &merged);
+    RegionUninit(&merged);
 
-    return shift;
+    /* The first frame after the backing pixmap was created is a full one */
+    scrpriv->backing_valid = TRUE;
 }
 
-void
-hostx_set_cmap_entry(ScreenPtr pScreen, unsigned char idx,
-                     unsigned char r, unsigned char g, unsigned char b) {
-    KdScreenPriv(pScreen);
-    ScrnInfoPtr screen = pScreenPriv->screen;
+static CARD32
+hostx_frame_timer(OsTimerPtr timer, CARD32 time, void *arg) {
+    ScrnInfoPtr screen = arg;
     EphyrScrPriv *scrpriv = screen->driverPrivate;
-/* need to calculate the shifts for RGB because server could be BGR. */
-/* XXX Not sure if this is correct for 8 on 16, but this works for 8 on 24.*/
-    static int rshift, bshift, gshift = 0;
-    static int first_time = 1;
+    RegionRec none;
 
-    if (first_time) {
-        first_time = 0;
-        rshift = hostx_calculate_color_shift(HostX.visual->red_mask);
-        gshift = hostx_calculate_color_shift(HostX.visual->green_mask);
-        bshift = hostx_calculate_color_shift(HostX.visual->blue_mask);
-    }
+    scrpriv->frame_pending = FALSE;
 
-    scrpriv->cmap[idx] = ((r << rshift) & HostX.visual->red_mask)   |
-                         ((g << gshift) & HostX.visual->green_mask) |
-                         ((b << bshift) & HostX.visual->blue_mask);
+    RegionNull(&none);
+    hostx_paint_frame(screen, &none);
+    RegionUninit(&none);
+
+    return 0;
 }
 
-void
-hostx_close_screen(ScrnInfoPtr screen) {
+/**
+ * Returns the descriptor the server should watch for the presenter of
+ * screen to hand buffers back, or -1 when frames do not go through it.
+ */
+int
+hostx_get_presenter_fd(ScrnInfoPtr screen) {
     EphyrScrPriv *scrpriv = screen->driverPrivate;
 
-    if (HostX.have_shm) {
-        xcb_shm_detach(HostX.conn, scrpriv->shminfo.shmseg);
-        shmdt(scrpriv->shminfo.shmaddr);
-        shmctl(scrpriv->shminfo.shmid, IPC_RMID, 0);
-    } else {
-        free(scrpriv->ximg->data);
-        scrpriv->ximg->data = NULL;
+    if (!scrpriv->threaded) {
+        return -1;
     }
 
-    xcb_image_destroy(scrpriv->ximg);
+    return ephyr_presenter_get_fd(scrpriv->presenter);
 }
 
 /**
- * hostx_screen_init creates the XImage that will contain the front buffer of
- * the ephyr screen, and possibly offscreen memory.
- *
- * @param width width of the screen
- * @param height height of the screen
- * @param buffer_height  height of the rectangle to be allocated.
- *
- * hostx_screen_init() creates an XImage, using MIT-SHM if it's available.
- * buffer_height can be used to create a larger offscreen buffer, which is used
- * by fakexa for storing offscreen pixmap data.
+ * Called when the descriptor of hostx_get_presenter_fd() is readable:
+ * presents the frame that found the presenter busy, unless the frame
+ * rate cap already has a timer for it.
  */
-void *
-hostx_screen_init(ScrnInfoPtr screen,
-                  int x, int y,
-                  int width, int height, int buffer_height,
-                  int *bytes_per_line, int *bits_per_pixel) {
+void
+hostx_presenter_done(ScrnInfoPtr screen) {
     EphyrScrPriv *scrpriv = screen->driverPrivate;
-    Bool shm_success = FALSE;
-
-    if (!scrpriv) {
-        fprintf(stderr, "%s: Error in accessing hostx data\n", __func__);
-        exit(1);
-    }
+    RegionRec none;
 
-    EPHYR_DBG("host_screen=%p x=%d, y=%d, wxh=%dx%d, buffer_height=%d",
-              screen, x, y, width, height, buffer_height);
+    ephyr_presenter_clear_fd(scrpriv->presenter);
 
-    if (scrpriv->ximg != NULL) {
-        /* Free up the image data if previously used
-         * i.ie called by server reset
-         */
-        hostx_close_screen(screen);
+    if (!scrpriv->presenter_retry || scrpriv->frame_pending) {
+        return;
     }
 
-    if (!ephyr_glamor && HostX.have_shm) {
-        scrpriv->ximg = xcb_image_create_native(HostX.conn,
-                                                width,
-                                                buffer_height,
-                                                XCB_IMAGE_FORMAT_Z_PIXMAP,
-                                                HostX.depth,
-                                                NULL,
-                                                ~0,
-                                                NULL);
+    RegionNull(&none);
+    hostx_paint_frame(screen, &none);
+    RegionUninit(&none);
+}
 
-        scrpriv->shminfo.shmid =
-            shmget(IPC_PRIVATE,
-                   scrpriv->ximg->stride * buffer_height,
-                   IPC_CREAT | 0777);
-        scrpriv->ximg->data = shmat(scrpriv->shminfo.shmid, 0, 0);
-        scrpriv->shminfo.shmaddr = scrpriv->ximg->data;
+/**
+ * Presents region, merged with any exposures.
+ *
+ * With a frame rate cap, the first frame after an idle period goes out
+ * at once for low latency.  Damage arriving before the frame interval is
+ * over only accumulates, and a timer presents all of it at the end of
+ * the interval.
+ */
+static void
+hostx_schedule_frame(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
 
-        if (scrpriv->ximg->data == (uint8_t *)-1) {
-            EPHYR_DBG
-                ("Can't attach SHM Segment, falling back to plain XImages");
-            HostX.have_shm = FALSE;
-            xcb_image_destroy (scrpriv->ximg);
-            shmctl(scrpriv->shminfo.shmid, IPC_RMID, 0);
-        } else {
-            EPHYR_DBG("SHM segment attached %p", scrpriv->shminfo.shmaddr);
-            scrpriv->shminfo.shmseg = xcb_generate_id(HostX.conn);
-            xcb_shm_attach(HostX.conn,
-                           scrpriv->shminfo.shmseg,
-                           scrpriv->shminfo.shmid,
-                           FALSE);
-            shm_success = TRUE;
-        }
-    }
+    if (HostX.frame_interval) {
+        CARD32 elapsed = GetTimeInMillis() - scrpriv->last_frame;
 
-    if (!ephyr_glamor && !shm_success) {
-        EPHYR_DBG("Creating image %dx%d for screen scrpriv=%p\n",
-                  width, buffer_height, scrpriv);
-        scrpriv->ximg = xcb_image_create_native(HostX.conn,
-                                                width,
-                                                buffer_height,
-                                                XCB_IMAGE_FORMAT_Z_PIXMAP,
-                                                HostX.depth,
-                                                NULL,
-                                                ~0,
-                                                NULL);
+        if (elapsed < HostX.frame_interval) {
+            RegionUnion(&scrpriv->pending_region, &scrpriv->pending_region,
+                        region);
 
-        /* Match server byte order so that the image can be converted to
-         * the native byte order by xcb_image_put() before drawing */
-        if (host_depth_matches_server(scrpriv)) {
-            scrpriv->ximg->byte_order = IMAGE_BYTE_ORDER;
-        }
+            if (!scrpriv->frame_pending) {
+                scrpriv->frame_timer =
+                    TimerSet(scrpriv->frame_timer, 0,
+                             HostX.frame_interval - elapsed,
+                             hostx_frame_timer, screen);
+                scrpriv->frame_pending = TRUE;
+            }
 
-        scrpriv->ximg->data =
-            xallocarray(scrpriv->ximg->stride, buffer_height);
+            return;
+        }
     }
 
-    {
-        uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-        uint32_t values[2] = {width, height};
-        xcb_configure_window(HostX.conn, scrpriv->win, mask, values);
+    hostx_paint_frame(screen, region);
+}
+
+/**
+ * Removes from region the tiles that hash the same as when the host last
+ * received them: clients often redraw identical pixels, which damages
+ * them all the same.  The hashes of the other damaged tiles are updated.
+ *
+ * Returns FALSE when no tile was removed.  Otherwise, what is left to
+ * paint is in changed, which the caller must uninit.
+ */
+static Bool
+hostx_tile_filter(EphyrScrPriv *scrpriv, RegionPtr region, RegionPtr changed) {
+    BoxPtr extents = RegionExtents(region);
+    int col1 = max(extents->x1, 0) / HOSTX_TILE_SIZE;
+    int row1 = max(extents->y1, 0) / HOSTX_TILE_SIZE;
+    int col2 = min((extents->x2 + HOSTX_TILE_SIZE - 1) / HOSTX_TILE_SIZE,
+                   scrpriv->tile_cols);
+    int row2 = min((extents->y2 + HOSTX_TILE_SIZE - 1) / HOSTX_TILE_SIZE,
+                   scrpriv->tile_rows);
+    int cpp = scrpriv->tile_cpp;
+    int col, row, n = 0;
+    xRectangle *rects;
+    RegionPtr same;
+
+    if (col1 >= col2 || row1 >= row2) {
+        return FALSE;
     }
 
-    if (scrpriv->win_pre_existing == None && !EphyrWantResize) {
-        /* Ask the WM to keep our size static */
-        xcb_size_hints_t size_hints = {0};
-        size_hints.max_width = size_hints.min_width = width;
-        size_hints.max_height = size_hints.min_height = height;
-        size_hints.flags = (XCB_ICCCM_SIZE_HINT_P_MIN_SIZE |
-                            XCB_ICCCM_SIZE_HINT_P_MAX_SIZE);
-        xcb_icccm_set_wm_normal_hints(HostX.conn, scrpriv->win,
-                                      &size_hints);
+    rects = xallocarray((col2 - col1) * (row2 - row1), sizeof(xRectangle));
+    if (!rects) {
+        memset(scrpriv->tile_hashes, 0,
+               scrpriv->tile_cols * scrpriv->tile_rows * sizeof(uint64_t));
+        return FALSE;
     }
 
-    xcb_map_window(HostX.conn, scrpriv->win);
+    for (row = row1; row < row2; row++) {
+        xRectangle *run = NULL;
 
-    /* Set explicit window position if it was informed in
-     * -screen option (WxH+X or WxH+X+Y). Otherwise, accept the
-     * position set by WM.
-     * The trick here is putting this code after xcb_map_window() call,
-     * so these values won't be overriden by WM. */
-    if (scrpriv->win_explicit_position) {
-        uint32_t mask = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y;
-        uint32_t values[2] = {x, y};
-        xcb_configure_window(HostX.conn, scrpriv->win, mask, values);
-    }
+        for (col = col1; col < col2; col++) {
+            uint64_t *hash = &scrpriv->tile_hashes[row * scrpriv->tile_cols +
+                                                   col];
+            BoxRec tile;
+            uint64_t value;
 
-    xcb_aux_sync(HostX.conn);
+            tile.x1 = col * HOSTX_TILE_SIZE;
+            tile.y1 = row * HOSTX_TILE_SIZE;
+            tile.x2 = min(tile.x1 + HOSTX_TILE_SIZE, scrpriv->fb_width);
+            tile.y2 = min(tile.y1 + HOSTX_TILE_SIZE, scrpriv->fb_height);
 
-    scrpriv->win_width = width;
-    scrpriv->win_height = height;
-    scrpriv->win_x = x;
-    scrpriv->win_y = y;
+            if (RegionContainsRect(region, &tile) == rgnOUT) {
+                run = NULL;
+                continue;
+            }
 
-/* XXX: GLAMOR support will be added later. */
-#ifdef GLAMOR
-    if (ephyr_glamor) {
-        *bytes_per_line = 0;
-        *bits_per_pixel = 0;
-        ephyr_glamor_set_window_size(scrpriv->glamor,
-                                     scrpriv->win_width,
-                                     scrpriv->win_height);
-        return NULL;
-    } else
-#endif
-    {
-        if (host_depth_matches_server(scrpriv)) {
-            *bytes_per_line = scrpriv->ximg->stride;
-            *bits_per_pixel = scrpriv->ximg->bpp;
+            value = ephyr_hash_block(scrpriv->tile_fb +
+                                     tile.y1 * scrpriv->tile_stride +
+                                     tile.x1 * cpp,
+                                     (tile.x2 - tile.x1) * cpp,
+                                     tile.y2 - tile.y1, scrpriv->tile_stride);
 
-            EPHYR_DBG("Host matches server");
-            return scrpriv->ximg->data;
-        } else {
-            int bytes_per_pixel = scrpriv->server_depth >> 3;
-            int stride = (width * bytes_per_pixel + 0x3) & ~0x3;
+            /* 0 stands for unknown */
+            if (!value) {
+                value = 1;
+            }
 
-            *bytes_per_line = stride;
-            *bits_per_pixel = scrpriv->server_depth;
+            if (value != *hash) {
+                *hash = value;
+                run = NULL;
+                continue;
+            }
 
-            EPHYR_DBG("server bpp %i", bytes_per_pixel);
-            scrpriv->fb_data = xallocarray(stride, buffer_height);
-            return scrpriv->fb_data;
+            /* Unchanged tiles next to each other make a single rectangle */
+            if (run) {
+                run->width += tile.x2 - tile.x1;
+            } else {
+                run = &rects[n++];
+                run->x = tile.x1;
+                run->y = tile.y1;
+                run->width = tile.x2 - tile.x1;
+                run->height = tile.y2 - tile.y1;
+            }
         }
     }
-}
-
-static void hostx_paint_debug_rect(ScrnInfoPtr screen,
-                                   int x, int y, int width, int height);
 
-void
-hostx_paint_rect(ScrnInfoPtr screen,
-                 int sx, int sy, int dx, int dy, int width, int height) {
-    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    if (!n) {
+        free(rects);
+        return FALSE;
+    }
 
-    EPHYR_DBG("painting in screen %d\n", scrpriv->mynum);
+    same = RegionFromRects(n, rects, CT_YXBANDED);
+    free(rects);
 
-/* XXX: GLAMOR support will be added later. */
-#ifdef GLAMOR
-    if (ephyr_glamor) {
-        BoxRec box;
-        RegionRec region;
+    RegionNull(changed);
+    RegionSubtract(changed, region, same);
+    RegionDestroy(same);
 
-        box.x1 = dx;
-        box.y1 = dy;
-        box.x2 = dx + width;
-        box.y2 = dy + height;
+    return TRUE;
+}
 
-        RegionInit(&region, &box, 1);
-        ephyr_glamor_damage_redisplay(scrpriv->glamor, &region);
-        RegionUninit(&region);
+/**
+ * hostx_paint_region presents the damaged region, merged with any
+ * exposures.  With tile hashing, the parts of it that did not actually
+ * change are left out.
+ */
+void
+hostx_paint_region(ScrnInfoPtr screen, RegionPtr region) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    RegionRec changed;
+
+    if (scrpriv->tile_hashes && RegionNotEmpty(region) &&
+        hostx_tile_filter(scrpriv, region, &changed)) {
+        EPHYR_DBG("%d of %d damaged boxes left after tile hashing",
+                  RegionNumRects(&changed), RegionNumRects(region));
+        hostx_schedule_frame(screen, &changed);
+        RegionUninit(&changed);
         return;
     }
-#endif
-
-    /*
-     *  Copy the image data updated by the shadow layer
-     *  on to the window
-     */
-    if (HostXWantDamageDebug) {
-        hostx_paint_debug_rect(screen, dx, dy, width, height);
-    }
 
-    /*
-     * If the depth of the ephyr server is less than that of the host,
-     * the kdrive fb does not point to the ximage data but to a buffer
-     * ( fb_data ), we shift the various bits from this onto the XImage
-     * so they match the host.
-     *
-     * Note, This code is pretty new ( and simple ) so may break on
-     *       endian issues, 32 bpp host etc.
-     *       Not sure if 8bpp case is right either.
-     *       ... and it will be slower than the matching depth case.
-     */
-    if (!host_depth_matches_server(scrpriv)) {
-        int x, y, idx, bytes_per_pixel = (scrpriv->server_depth >> 3);
-        int stride = (scrpriv->win_width * bytes_per_pixel + 0x3) & ~0x3;
-        unsigned char r, g, b;
-        unsigned long host_pixel;
+    hostx_schedule_frame(screen, region);
+}
 
-        EPHYR_DBG("Unmatched host depth scrpriv=%p\n", scrpriv);
-        for (y = sy; y < sy + height; y++) {
-            for (x = sx; x < sx + width; x++) {
-                idx = y * stride + x * bytes_per_pixel;
+/**
+ * Records that the host lost the content of a window rectangle.  Nothing
+ * is painted before the next hostx_paint_region() or
+ * hostx_paint_exposures(), so a whole series of Expose events ends up in
+ * one frame.
+ */
+void
+hostx_add_exposure(ScrnInfoPtr screen, int x, int y, int width, int height) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    BoxRec box;
+    RegionRec exposed;
 
-                switch (scrpriv->server_depth) {
-                case 16:
-                {
-                    unsigned short pixel =
-                        *(unsigned short *) (scrpriv->fb_data + idx);
+    box.x1 = max(x, 0);
+    box.y1 = max(y, 0);
+    box.x2 = min(x + width, scrpriv->fb_width);
+    box.y2 = min(y + height, scrpriv->fb_height);
 
-                    r = ((pixel & 0xf800) >> 8);
-                    g = ((pixel & 0x07e0) >> 3);
-                    b = ((pixel & 0x001f) << 3);
+    if (box.x1 >= box.x2 || box.y1 >= box.y2) {
+        return;
+    }
 
-                    host_pixel = (r << 16) | (g << 8) | (b);
+    RegionInit(&exposed, &box, 1);
+    RegionUnion(&scrpriv->pending_region, &scrpriv->pending_region, &exposed);
 
-                    xcb_image_put_pixel(scrpriv->ximg, x, y, host_pixel);
-                    break;
-                }
-                case 8:
-                {
-                    unsigned char pixel =
-                        *(unsigned char *) (scrpriv->fb_data + idx);
-                    xcb_image_put_pixel(scrpriv->ximg, x, y,
-                                        scrpriv->cmap[pixel]);
-                    break;
-                }
-                default:
-                    break;
-                }
-            }
-        }
+    /* The window lost those pixels, scrolls must not copy from them */
+    if (scrpriv->scroll_prev) {
+        RegionSubtract(&scrpriv->scroll_known, &scrpriv->scroll_known,
+                       &exposed);
     }
 
-    if (HostX.have_shm) {
-        xcb_image_shm_put(HostX.conn, scrpriv->win,
-                          HostX.gc, scrpriv->ximg,
-                          scrpriv->shminfo,
-                          sx, sy, dx, dy, width, height, FALSE);
-    } else {
-        xcb_image_t *subimg = xcb_image_subimage(scrpriv->ximg, sx, sy,
-                                                 width, height, 0, 0, 0);
-        xcb_image_t *img = xcb_image_native(HostX.conn, subimg, 1);
-        xcb_image_put(HostX.conn, scrpriv->win, HostX.gc, img, dx, dy, 0);
+    RegionUninit(&exposed);
+}
 
-        if (subimg != img) {
-            xcb_image_destroy(img);
-        }
+/**
+ * Paints the exposures no damage was painted with since they arrived,
+ * unless a frame is already scheduled.
+ */
+void
+hostx_paint_exposures(ScrnInfoPtr screen) {
+    EphyrScrPriv *scrpriv = screen->driverPrivate;
+    RegionRec none;
 
-        xcb_image_destroy(subimg);
+    if (!RegionNotEmpty(&scrpriv->pending_region)) {
+        return;
     }
 
-    xcb_aux_sync(HostX.conn);
+    RegionNull(&none);
+    hostx_schedule_frame(screen, &none);
+    RegionUninit(&none);
 }
 
 static void
@@ -1333,6 +4407,7 @@ hostx_create_window(int a_screen_number,
     } else {
         EPHYR_LOG_ERROR("multiple peer windows created for same screen\n");
     }
+    ephyr_window_register(win, scrpriv);
 
     xcb_flush(HostX.conn);
     xcb_map_window(HostX.conn, win);
@@ -1345,6 +4420,13 @@ hostx_create_window(int a_screen_number,
 
 int
 hostx_destroy_window(int a_win) {
+    const EphyrHostWindow *window = ephyr_window_lookup(a_win);
+
+    if (window && window->scrpriv->peer_win == a_win) {
+        window->scrpriv->peer_win = XCB_NONE;
+    }
+    ephyr_window_unregister(a_win);
+
     xcb_destroy_window(HostX.conn, a_win);
     xcb_flush(HostX.conn);
     return TRUE;
@@ -30,6 +30,7 @@
 #include <X11/Xmd.h>
 #include <xcb/xcb.h>
 #include <xcb/render.h>
+#include <xcb/xinput.h>
 #include "ephyr.h"
 
 #define EPHYR_WANT_DEBUG 0
@@ -43,6 +44,10 @@
 
 typedef struct EphyrHostXVars EphyrHostXVars;
 
+/* Classes of host keys, as returned by hostx_get_key_class() */
+#define EPHYR_KEY_CLASS_SHIFT   (1 << 0)
+#define EPHYR_KEY_CLASS_CONTROL (1 << 1)
+
 typedef struct {
     int minKeyCode;
     int maxKeyCode;
@@ -83,12 +88,35 @@ void hostx_get_output_geometry(const char *output,
                                int *width, int *height);
 void hostx_use_fullscreen(void);
 Bool hostx_want_fullscreen(void);
+void hostx_use_async_present(int max_frames_in_flight);
+void hostx_use_shm_buffers(int n_buffers);
+void hostx_use_huge_pages(void);
+void hostx_use_present(void);
+void hostx_use_present_threads(int n_threads);
+void hostx_use_scroll_detection(void);
+void hostx_use_host_transform(double scale);
+void hostx_use_backing_pixmap(void);
+void hostx_use_max_fps(int max_fps);
+void hostx_use_presenter_thread(void);
+void hostx_use_tile_hash(void);
+void hostx_use_xinput2(void);
+int hostx_get_xi2_opcode(void);
+void hostx_xi2_device_changed(void);
+void hostx_xi2_enter(void);
+Bool hostx_xi2_scroll(xcb_input_motion_event_t *ev, double *dx, double *dy);
+Bool hostx_want_host_transform(ScrnInfoPtr screen);
+void hostx_unscale_pointer(ScrnInfoPtr screen, int *x, int *y);
+void hostx_unscale_pointer_fp(ScrnInfoPtr screen, double *x, double *y);
+Bool hostx_expose_rect(ScrnInfoPtr screen, int x, int y, int width, int height);
+void hostx_add_exposure(ScrnInfoPtr screen, int x, int y, int width, int height);
+void hostx_paint_exposures(ScrnInfoPtr screen);
 Bool hostx_want_preexisting_window(ScrnInfoPtr screen);
 void hostx_use_preexisting_window(unsigned long win_id);
 void hostx_use_resname(char *name, int fromcmd);
 void hostx_set_title(char *name);
 void hostx_handle_signal(int signum);
 Bool hostx_init(void);
+void hostx_fini(void);
 Bool hostx_init_window(ScrnInfoPtr screen);
 void hostx_add_screen(ScrnInfoPtr screen, unsigned long win_id, int screen_num, Bool use_geometry, const char *output);
 void hostx_set_display_name(char *name);
@@ -102,13 +130,19 @@ void hostx_get_visual_masks(ScrnInfoPtr screen,
 void hostx_set_cmap_entry(ScreenPtr pScreen, unsigned char idx,
                           unsigned char r, unsigned char g, unsigned char b);
 void hostx_close_screen(ScrnInfoPtr screen);
+void hostx_free_screen(ScrnInfoPtr screen);
+int hostx_get_presenter_fd(ScrnInfoPtr screen);
+void hostx_presenter_done(ScrnInfoPtr screen);
 void *hostx_screen_init(ScrnInfoPtr screen,
                         int x, int y,
                         int width, int height, int buffer_height,
                         int *bytes_per_line, int *bits_per_pixel);
 void hostx_paint_rect(ScrnInfoPtr screen,
                       int sx, int sy, int dx, int dy, int width, int height);
+void hostx_paint_region(ScrnInfoPtr screen, RegionPtr region);
+Bool hostx_process_event(xcb_generic_event_t *xev);
 Bool hostx_load_keymap(void);
+uint8_t hostx_get_key_class(uint8_t keycode);
 xcb_connection_t *hostx_get_xcbconn(void);
 int hostx_get_screen(void);
 int hostx_get_window(int a_screen_number);